@@ -0,0 +1,75 @@
+//
+//  aggregate.h
+//  sqb
+//
+//  Aggregate policies for augmented trees.
+//
+//  An aggregate is a monoid over the (key, value) pairs of a subtree:
+//  lift() maps one pair into it, combine() joins the aggregates of two
+//  adjacent key ranges (left first) and identity() is the aggregate of an
+//  empty range. A tree keeps the aggregate of every subtree next to its
+//  size, so any key range can be summarized from O(log n) nodes.
+//  no_aggregate keeps nothing and costs nothing.
+//
+
+#ifndef aggregate_h
+#define aggregate_h
+
+#include <limits>
+
+
+//---------------------------------------------------------
+struct no_aggregate {
+  typedef void type;
+};
+
+// storage a node inherits for its subtree aggregate; empty for no_aggregate
+template <typename Aggregate>
+struct aggregate_slot {
+  typename Aggregate::type agg;
+};
+
+template <>
+struct aggregate_slot<no_aggregate> { };
+
+
+//---------------------------------------------------------
+template <typename T>
+struct sum_aggregate {
+  typedef T type;
+  static T identity() { return T(); }
+  template <typename K, typename V>
+  static T lift(const K&, const V& v) { return T(v); }
+  static T combine(const T& a, const T& b) { return a + b; }
+};
+
+template <typename T>
+struct min_aggregate {
+  typedef T type;
+  static T identity() { return std::numeric_limits<T>::max(); }
+  template <typename K, typename V>
+  static T lift(const K&, const V& v) { return T(v); }
+  static T combine(const T& a, const T& b) { return b < a ? b : a; }
+};
+
+template <typename T>
+struct max_aggregate {
+  typedef T type;
+  static T identity() { return std::numeric_limits<T>::lowest(); }
+  template <typename K, typename V>
+  static T lift(const K&, const V& v) { return T(v); }
+  static T combine(const T& a, const T& b) { return a < b ? b : a; }
+};
+
+// number of pairs, which size(lo, hi) already answers from the size fields
+template <typename T = int>
+struct count_aggregate {
+  typedef T type;
+  static T identity() { return T(); }
+  template <typename K, typename V>
+  static T lift(const K&, const V&) { return T(1); }
+  static T combine(const T& a, const T& b) { return a + b; }
+};
+
+
+#endif /* aggregate_h */
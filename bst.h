@@ -14,9 +14,11 @@
 #include <fstream>
 #include <cassert>
 #include "queue.h"
+#include "utils.h"
 
 
-template <typename Key, typename Value>
+// Compare is a three-way policy (three_way in utils.h): one call per node
+template <typename Key, typename Value, typename Compare = three_way<Key>>
 class bst {
 private:
   struct node {
@@ -39,9 +41,10 @@ private:
   };
 
   node* root;
+  Compare comp;
 
 public:
-  bst() : root(nullptr) { }
+  explicit bst(const Compare& comp_ = Compare()) : root(nullptr), comp(comp_) { }
 
   bool empty() { return size() == 0; }
 
@@ -61,10 +64,13 @@ public:
 private:
   Value get(node* x, Key& key) {
     if (key == Key()) { throw new std::invalid_argument("calls get() with a null key"); }
-    if (x->key == Key()) { return Value(); }
-    if      (less(key,    x->key)) { return get(x->left,  key); }
-    else if (less(x->key, key))    { return get(x->right, key); }
-    else                           { return x->val; }
+    while (x != nullptr) {
+      int cmp = comp(key, x->key);
+      if      (cmp < 0) { x = x->left; }
+      else if (cmp > 0) { x = x->right; }
+      else              { return x->val; }
+    }
+    return Value();
   }
 
 public:
@@ -81,9 +87,10 @@ private:
   node* put(node* x, Key key, Value val) {
     if (x == nullptr) { return new node(key, val, 1); }
 
-    if      (less(key,    x->key)) { x->left  = put(x->left,  key, val); }
-    else if (less(x->key, key))    { x->right = put(x->right, key, val); }
-    else                           { x->val   = val; }
+    int cmp = comp(key, x->key);
+    if      (cmp < 0) { x->left  = put(x->left,  key, val); }
+    else if (cmp > 0) { x->right = put(x->right, key, val); }
+    else              { x->val   = val; }
     x->size = 1 + size(x->left) + size(x->right);
     return x;
   }
@@ -127,8 +134,9 @@ private:
   node* delete_key(node* x, Key& key) {
     if (x == nullptr) { return nullptr; }
 
-    if      (less(key,    x->key)) { x->left  = delete_key(x->left,  key); }
-    else if (less(x->key, key))    { x->right = delete_key(x->right, key); }
+    int cmp = comp(key, x->key);
+    if      (cmp < 0) { x->left  = delete_key(x->left,  key); }
+    else if (cmp > 0) { x->right = delete_key(x->right, key); }
     else {
       if (x->right == nullptr) { return x->left; }
       if (x->left  == nullptr) { return x->right; }
@@ -141,6 +149,86 @@ private:
     return x;
   }
 
+public:
+  // removes every key in [low, high]; returns how many there were. The
+  // search paths for low and high bound the range, so it is cut off in
+  // O(height) and its nodes are deleted in one walk. fn(key, value), if
+  // given, sees each removed entry in key order before it is deleted
+  int delete_range(Key& low, Key& high) { return delete_range(low, high, [](const Key&, const Value&) { }); }
+
+  template <typename F>
+  int delete_range(Key& low, Key& high, F fn) {
+    if (low == Key())  { throw new std::invalid_argument("first argument to delete_range() is null"); }
+    if (high == Key()) { throw new std::invalid_argument("second argument to delete_range() is null"); }
+
+    if (comp(low, high) > 0) { return 0; }
+    int n = size();
+    root = delete_range(root, low, high, fn);
+    assert(check());
+    return n - size();
+  }
+
+private:
+  template <typename F>
+  node* delete_range(node* x, Key& low, Key& high, F& fn) {
+    if (x == nullptr) { return nullptr; }
+
+    if      (comp(x->key, low)  < 0) { x->right = delete_range(x->right, low, high, fn); }
+    else if (comp(x->key, high) > 0) { x->left  = delete_range(x->left,  low, high, fn); }
+    else {
+      // x is in the range: of its subtrees only the keys below low and above high stay
+      node* l = keep_below(x->left, low, fn);
+      fn(x->key, x->val);
+      node* r = keep_above(x->right, high, fn);
+      delete x;
+      if (r == nullptr) { return l; }
+      x = min(r);
+      x->right = delete_min(r);
+      x->left = l;
+    }
+    x->size = size(x->left) + size(x->right) + 1;
+    return x;
+  }
+
+  template <typename F>
+  node* keep_below(node* x, Key& low, F& fn) {
+    if (x == nullptr) { return nullptr; }
+    if (comp(x->key, low) < 0) {
+      x->right = keep_below(x->right, low, fn);
+      x->size = size(x->left) + size(x->right) + 1;
+      return x;
+    }
+    node* kept = keep_below(x->left, low, fn);
+    fn(x->key, x->val);
+    drop(x->right, fn);
+    delete x;
+    return kept;
+  }
+
+  template <typename F>
+  node* keep_above(node* x, Key& high, F& fn) {
+    if (x == nullptr) { return nullptr; }
+    if (comp(x->key, high) > 0) {
+      x->left = keep_above(x->left, high, fn);
+      x->size = size(x->left) + size(x->right) + 1;
+      return x;
+    }
+    drop(x->left, fn);
+    fn(x->key, x->val);
+    node* right = x->right;
+    delete x;
+    return keep_above(right, high, fn);
+  }
+
+  template <typename F>
+  void drop(node* x, F& fn) {
+    if (x == nullptr) { return; }
+    drop(x->left, fn);
+    fn(x->key, x->val);
+    drop(x->right, fn);
+    delete x;
+  }
+
 public:
   Key min() {
     if (empty()) { throw new std::logic_error("calls min() with empty symbol table"); }
@@ -158,64 +246,45 @@ private:
   node* max(node* x) { return x->right == nullptr ? x : max(x->right); }
 
 public:
-  Key floor(Key& key) {
+  // largest key <= key
+  Key floor(const Key& key) {
     if (key == Key())   { throw new std::invalid_argument("argument to floor() is null"); }
     if (empty())        { throw new std::logic_error("calls floor() with empty symbol table"); }
-    node x = floor(root, key);
+    node* x = floor(root, key);
     if (x == nullptr)   { throw new std::logic_error("argument to floor() is too small"); }
     else { return x->key; }
   }
 private:
-  node floor(node* x, Key key) {
-    if (x == nullptr) { return nullptr; }
-
-    bool key_less = less(key,    x->key);
-    bool key_more = less(x->key, key);
-    
-    if (key_less && key_more) { return x; }  // equal
-    if (key_less)             { return floor(x->left, key); }
-
-    node* t = floor(x->right, key);
-    if (t != nullptr) { return t; }
-  }
-
-public:
-  Key floor2(Key& key) {
-    Key x = floor2(root, key, nullptr);
-    if (x == nullptr) { throw new std::logic_error("argument to floor() is too small"); }
-    else return x;
-  }
-private:
-  Key floor2(node* x, Key key, Key best) {
-    if (x == nullptr) { return best; }
-    
-    int cmp = key.compareTo(x->key);
-    if      (cmp  < 0) { return floor2(x->left, key, best); }
-    else if (cmp  > 0) { return floor2(x->right, key, x->key); }
-    else               { return x->key; }
+  node* floor(node* x, const Key& key) {
+    node* best = nullptr;
+    while (x != nullptr) {
+      int cmp = comp(key, x->key);
+      if      (cmp == 0) { return x; }
+      else if (cmp  < 0) { x = x->left; }
+      else               { best = x;  x = x->right; }
+    }
+    return best;
   }
 
 public:
-  Key ceiling(Key& key) {
+  // smallest key >= key
+  Key ceiling(const Key& key) {
     if (key == Key())   { throw new std::invalid_argument("argument to ceiling() is null"); }
     if (empty())        { throw new std::logic_error("calls ceiling() with empty symbol table"); }
-    node x = ceiling(root, key);
-    if (x == Key())     { throw new std::logic_error("argument to floor() is too large"); }
+    node* x = ceiling(root, key);
+    if (x == nullptr)   { throw new std::logic_error("argument to ceiling() is too large"); }
     else { return x->key; }
   }
 private:
-  node* ceiling(node* x, Key key) {
-    if (x == Key()) { return nullptr; }
-
-    bool key_less = less(key,    x->key);
-    bool key_more = less(x->key, key);
-    
-    if (key_less && key_more) { return x; }  // equal
-    if (key_less) {
-      node* t = ceiling(x->left, key);
-      return t != nullptr ? t : x;
+  node* ceiling(node* x, const Key& key) {
+    node* best = nullptr;
+    while (x != nullptr) {
+      int cmp = comp(key, x->key);
+      if      (cmp == 0) { return x; }
+      else if (cmp  > 0) { x = x->right; }
+      else               { best = x;  x = x->left; }
     }
-    return ceiling(x->right, key);
+    return best;
   }
 
 public:
@@ -245,17 +314,18 @@ private:
   int rank(Key key, node* x) {
     if (x == nullptr) { return 0; }
     
-    if      (less(key,    x->key)) { return rank(key, x->left); }
-    else if (less(x->key, key))    { return 1 + size(x->left) + rank(key, x->right); }
-    else                           { return size(x->left); }
+    int cmp = comp(key, x->key);
+    if      (cmp < 0) { return rank(key, x->left); }
+    else if (cmp > 0) { return 1 + size(x->left) + rank(key, x->right); }
+    else              { return size(x->left); }
   }
 
 public:
   void keys(node* x, queue_<Key>& q, Key low, Key high) {
     if (x == nullptr) { return; }
 
-    bool low_le  = less(low, x->key)  || low  == x->key;
-    bool high_ge = less(x->key, high) || high == x->key;
+    bool low_le  = comp(low, x->key)  <= 0;
+    bool high_ge = comp(high, x->key) >= 0;
     
     if (low_le)             { keys(x->left, q, low, high); }   // le == less than or equal to (a la Python)
     if (low_le && high_ge)  { q.enqueue(x->key); }             // ge == greater than or equal to
@@ -281,7 +351,7 @@ public:
     if (low == Key())  { throw new std::invalid_argument("first argument to size() is null"); }
     if (high == Key()) { throw new std::invalid_argument("second argument to size() is null"); }
 
-    if (low.compareTo(high) > 0) { return 0; }
+    if (comp(low, high) > 0) { return 0; }
     if (contains(high)) { return rank(high) - rank(low) + 1; }
     else                { return rank(high) - rank(low); }
   }
@@ -326,8 +396,8 @@ private:
     if (x == nullptr) { return true; }
     Key default_key = Key();
     
-    if (min != default_key && less(x->key, min) <= 0) { return false; }
-    if (max != default_key && less(max,    x->key))   { return false; }
+    if (min != default_key && comp(x->key, min) <= 0) { return false; }
+    if (max != default_key && comp(x->key, max) >= 0) { return false; }
     bool left_bst = is_bst(x->left, min, x->key);
     bool right_bst = is_bst(x->left, min, x->key);
     return left_bst && right_bst;
@@ -347,9 +417,7 @@ private:
     }
     for (Key& key : keys()) {
       Key key_at_rank = select(rank(key));
-      if (less(key, key_at_rank) || less(key_at_rank, key)) {  // if !equal
-        return false;
-      }
+      if (comp(key, key_at_rank) != 0) { return false; }
     }
     return true;
   }
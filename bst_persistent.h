@@ -0,0 +1,400 @@
+//
+//  bst_persistent.h
+//  sqb
+//
+//  Persistent (path-copying) left-leaning red-black tree.
+//
+//  Nodes are reference counted. A mutation copies a node only when someone
+//  else still holds it, i.e. the O(log n) nodes on the root-to-leaf path
+//  (plus the few that rotations touch) that are shared with a snapshot;
+//  nodes owned by the writer alone are updated in place. snapshot() hands
+//  out an immutable version in O(1) by taking a reference on the root, and a
+//  node is freed by whichever thread drops its last reference. Readers of a
+//  version never take a lock and never write to the tree, so they cannot
+//  block the writer. There is one writer: put/delete_/snapshot() must not
+//  run concurrently with each other. A version may be used from any thread
+//  once that thread holds its own copy, but handing one over needs a
+//  publication step that does not block the writer: an atomic pointer to
+//  the current version whose old values are reclaimed through an
+//  epoch_domain, as bench_readers and concurrent_st do.
+//
+
+#ifndef bst_persistent_h
+#define bst_persistent_h
+
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "epoch.h"
+#include "queue.h"
+#include "utils.h"
+
+
+template <typename Key, typename Value>
+class bst_persistent {
+private:
+  static const bool RED = true;
+  static const bool BLACK = false;
+
+  struct node {
+    Key key;
+    Value val;
+    node* left;
+    node* right;
+    bool color;
+    int size;
+    std::atomic<int> refs;
+
+    node(const Key& key_, const Value& val_, bool color_, int size_, node* left_, node* right_)
+    : key(key_), val(val_), left(left_), right(right_), color(color_), size(size_), refs(1) { }
+  };
+
+  static void retain(node* x) {
+    if (x != nullptr) { x->refs.fetch_add(1, std::memory_order_relaxed); }
+  }
+  static void release(node* x) {
+    while (x != nullptr && x->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      node* right = x->right;
+      release(x->left);
+      delete x;
+      x = right;
+    }
+  }
+
+public:
+  //-------- immutable version of the tree ----------------------------------------
+  class version {
+  public:
+    version() : root_(nullptr) { }
+    version(const version& other) : root_(other.root_) { retain(root_); }
+    version(version&& other) : root_(other.root_) { other.root_ = nullptr; }
+    version& operator=(version other) { std::swap(root_, other.root_);  return *this; }
+    ~version() { release(root_); }
+
+    int size() const { return bst_persistent::size(root_); }
+    bool empty() const { return root_ == nullptr; }
+    Value get(const Key& k) const { return bst_persistent::get(root_, k); }
+    bool contains(const Key& k) const { return get(k) != Value(); }
+    Key min() const { return bst_persistent::min(root_); }
+    Key max() const { return bst_persistent::max(root_); }
+    int rank(const Key& k) const { return bst_persistent::rank(root_, k); }
+    Key select(int r) const { return bst_persistent::select(root_, r); }
+    array_queue<Key> keys(const Key& low, const Key& high) const {
+      array_queue<Key> q;
+      bst_persistent::keys(root_, q, low, high);
+      return q;
+    }
+
+  private:
+    friend class bst_persistent;
+    explicit version(node* root) : root_(root) { }   // takes over one reference
+    node* root_;
+  };
+
+  //-------- writer ------------------------------------------------------------------
+  bst_persistent() : root_(nullptr) { }
+  bst_persistent(const bst_persistent&) = delete;
+  bst_persistent& operator=(const bst_persistent&) = delete;
+  ~bst_persistent() { release(root_); }
+
+  // O(1): the version keeps every node it can reach alive
+  version snapshot() const {
+    retain(root_);
+    return version(root_);
+  }
+
+  int size() const { return size(root_); }
+  bool empty() const { return root_ == nullptr; }
+  bool is_empty() const { return empty(); }
+  Value get(const Key& k) const { return get(root_, k); }
+  bool contains(const Key& k) const { return get(k) != Value(); }
+  Key min() const { return min(root_); }
+  Key max() const { return max(root_); }
+  int rank(const Key& k) const { return rank(root_, k); }
+  Key select(int r) const { return select(root_, r); }
+
+  void put(const Key& k, const Value& v) {
+    if (k == Key()) { throw new std::invalid_argument("first argument to put() is null"); }
+    if (v == Value()) { delete_(k);  return; }
+    root_ = put(root_, k, v);
+    root_->color = BLACK;
+  }
+
+  void delete_min() {
+    if (empty()) { throw new std::logic_error("BST underflow"); }
+    root_ = own(root_);
+    if (!is_red(root_->left) && !is_red(root_->right)) { root_->color = RED; }
+    root_ = delete_min(root_);
+    if (!empty()) { root_ = own(root_);  root_->color = BLACK; }
+  }
+
+  void delete_max() {
+    if (empty()) { throw new std::logic_error("BST underflow"); }
+    root_ = own(root_);
+    if (!is_red(root_->left) && !is_red(root_->right)) { root_->color = RED; }
+    root_ = delete_max(root_);
+    if (!empty()) { root_ = own(root_);  root_->color = BLACK; }
+  }
+
+  // one descent whether or not k is there; returns whether it was. A miss
+  // still copies the shared nodes on its path, like a hit
+  bool delete_(const Key& k) {
+    if (k == Key()) { throw new std::invalid_argument("argument to delete_() is null"); }
+    if (empty()) { return false; }
+    root_ = own(root_);
+    if (!is_red(root_->left) && !is_red(root_->right)) { root_->color = RED; }
+    bool found = false;
+    root_ = delete_(root_, k, found);
+    if (!empty()) { root_ = own(root_);  root_->color = BLACK; }
+    return found;
+  }
+
+private:
+  //-------- copy on write -------------------------------------------------------
+  // returns a node the writer may modify: x itself if nobody else holds it,
+  // otherwise a copy that takes over the caller's reference
+  static node* own(node* x) {
+    if (x == nullptr || x->refs.load(std::memory_order_acquire) == 1) { return x; }
+    node* c = new node(x->key, x->val, x->color, x->size, x->left, x->right);
+    retain(c->left);
+    retain(c->right);
+    release(x);
+    return c;
+  }
+
+  //-------- read-only helpers shared with version ---------------------------------
+  static bool is_red(const node* x) { return x != nullptr && x->color == RED; }
+  static int size(const node* x) { return x == nullptr ? 0 : x->size; }
+
+  static Value get(const node* x, const Key& k) {
+    while (x != nullptr) {
+      if      (k < x->key) { x = x->left; }
+      else if (x->key < k) { x = x->right; }
+      else                 { return x->val; }
+    }
+    return Value();
+  }
+  static Key min(const node* x) {
+    if (x == nullptr) { throw new std::logic_error("calls min() with empty symbol table"); }
+    while (x->left != nullptr) { x = x->left; }
+    return x->key;
+  }
+  static Key max(const node* x) {
+    if (x == nullptr) { throw new std::logic_error("calls max() with empty symbol table"); }
+    while (x->right != nullptr) { x = x->right; }
+    return x->key;
+  }
+  static int rank(const node* x, const Key& k) {
+    int r = 0;
+    while (x != nullptr) {
+      if      (k < x->key) { x = x->left; }
+      else if (x->key < k) { r += size(x->left) + 1;  x = x->right; }
+      else                 { return r + size(x->left); }
+    }
+    return r;
+  }
+  static Key select(const node* x, int r) {
+    if (r < 0 || r >= size(x)) { throw new std::invalid_argument("invalid select"); }
+    while (true) {
+      int left_size = size(x->left);
+      if      (left_size > r) { x = x->left; }
+      else if (left_size < r) { r -= left_size + 1;  x = x->right; }
+      else                    { return x->key; }
+    }
+  }
+  static void keys(const node* x, queue_<Key>& q, const Key& low, const Key& high) {
+    if (x == nullptr) { return; }
+    bool low_le  = !(x->key < low);
+    bool high_ge = !(high < x->key);
+    if (low_le)            { keys(x->left, q, low, high); }
+    if (low_le && high_ge) { q.enqueue(x->key); }
+    if (high_ge)           { keys(x->right, q, low, high); }
+  }
+
+  //-------- path-copying red-black operations --------------------------------------
+  // every function receives and returns an owned node (see own())
+  static node* put(node* h, const Key& k, const Value& v) {
+    if (h == nullptr) { return new node(k, v, RED, 1, nullptr, nullptr); }
+    h = own(h);
+    if      (k < h->key) { h->left  = put(h->left,  k, v); }
+    else if (h->key < k) { h->right = put(h->right, k, v); }
+    else                 { h->val = v; }
+
+    if (is_red(h->right) && !is_red(h->left))      { h = rotate_left(h); }
+    if (is_red(h->left) && is_red(h->left->left))  { h = rotate_right(h); }
+    if (is_red(h->left) && is_red(h->right))       { flip_colors(h); }
+    h->size = size(h->left) + size(h->right) + 1;
+    return h;
+  }
+
+  static node* delete_min(node* h) {
+    if (h->left == nullptr) { release(h);  return nullptr; }
+    if (!is_red(h->left) && !is_red(h->left->left)) { h = move_red_left(h); }
+    h->left = delete_min(own(h->left));
+    return balance(h);
+  }
+
+  static node* delete_max(node* h) {
+    if (is_red(h->left)) { h = rotate_right(h); }
+    if (h->right == nullptr) { release(h);  return nullptr; }
+    if (!is_red(h->right) && !is_red(h->right->left)) { h = move_red_right(h); }
+    h->right = delete_max(own(h->right));
+    return balance(h);
+  }
+
+  // a missing k ends the descent at a null link and is rebalanced on the
+  // way back up like a hit
+  static node* delete_(node* h, const Key& k, bool& found) {
+    if (k < h->key) {
+      if (h->left == nullptr) { return balance(h); }
+      if (!is_red(h->left) && !is_red(h->left->left)) { h = move_red_left(h); }
+      h->left = delete_(own(h->left), k, found);
+    } else {
+      if (is_red(h->left)) { h = rotate_right(h); }
+      if (h->right == nullptr) {
+        if (h->key < k) { return balance(h); }
+        release(h);
+        found = true;
+        return nullptr;
+      }
+      if (!is_red(h->right) && !is_red(h->right->left)) { h = move_red_right(h); }
+      if (!(h->key < k)) {
+        const node* m = h->right;
+        while (m->left != nullptr) { m = m->left; }
+        h->key = m->key;
+        h->val = m->val;
+        h->right = delete_min(own(h->right));
+        found = true;
+      } else {
+        h->right = delete_(own(h->right), k, found);
+      }
+    }
+    return balance(h);
+  }
+
+  static node* rotate_right(node* h) {
+    node* x = own(h->left);
+    h->left = x->right;
+    x->right = h;
+    x->color = h->color;
+    h->color = RED;
+    x->size = h->size;
+    h->size = size(h->left) + size(h->right) + 1;
+    return x;
+  }
+  static node* rotate_left(node* h) {
+    node* x = own(h->right);
+    h->right = x->left;
+    x->left = h;
+    x->color = h->color;
+    h->color = RED;
+    x->size = h->size;
+    h->size = size(h->left) + size(h->right) + 1;
+    return x;
+  }
+  static void flip_colors(node* h) {
+    h->left = own(h->left);
+    h->right = own(h->right);
+    h->color = !h->color;
+    h->left->color = !h->left->color;
+    h->right->color = !h->right->color;
+  }
+  static node* move_red_left(node* h) {
+    flip_colors(h);
+    if (is_red(h->right->left)) {
+      h->right = rotate_right(h->right);
+      h = rotate_left(h);
+      flip_colors(h);
+    }
+    return h;
+  }
+  static node* move_red_right(node* h) {
+    flip_colors(h);
+    if (is_red(h->left->left)) {
+      h = rotate_right(h);
+      flip_colors(h);
+    }
+    return h;
+  }
+  static node* balance(node* h) {
+    if (is_red(h->right))                          { h = rotate_left(h); }
+    if (is_red(h->left) && is_red(h->left->left))  { h = rotate_right(h); }
+    if (is_red(h->left) && is_red(h->right))       { flip_colors(h); }
+    h->size = size(h->left) + size(h->right) + 1;
+    return h;
+  }
+
+  node* root_;
+
+  //-------- benchmark ----------------------------------------------------------------
+public:
+  // read throughput of `readers` threads doing gets while one writer keeps
+  // putting and deleting: versions published by the writer through an
+  // atomic pointer (readers take no lock and hold no reference; replaced
+  // versions go to an epoch_domain) vs one mutex around a plain tree
+  static void bench_readers(int n, int readers, double seconds) {
+    std::cout << "bench_readers: " << n << " keys, " << readers << " readers, 1 writer\n";
+    for (int mode = 0; mode < 2; ++mode) {
+      bst_persistent st;
+      for (int i = 1; i <= n; ++i) { st.put(i, i); }
+      std::mutex lock;                 // mode 0: guards st
+      std::atomic<version*> published(new version(st.snapshot()));
+      epoch_domain epochs;
+      std::atomic<bool> stop(false);
+      std::atomic<long> reads(0), writes(0), found(0);
+
+      std::thread writer([&] {
+        long w = 0;
+        for (int i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+          int k = i % n + 1;
+          if (mode == 0) {
+            std::lock_guard<std::mutex> guard(lock);
+            st.delete_(k);
+            st.put(k, k);
+          } else {
+            st.delete_(k);
+            st.put(k, k);
+            epochs.retire(published.exchange(new version(st.snapshot())));
+          }
+          ++w;
+        }
+        writes = w;
+      });
+      std::vector<std::thread> rs;
+      for (int r = 0; r < readers; ++r) {
+        rs.emplace_back([&, r] {
+          long done = 0, hits = 0;
+          unsigned x = 12345 + r;
+          while (!stop.load(std::memory_order_relaxed)) {
+            if (mode == 0) {
+              std::lock_guard<std::mutex> guard(lock);
+              for (int i = 0; i < 64; ++i) { x = x * 1103515245 + 12345;  hits += st.get((int)(x % n) + 1) != Value(); }
+            } else {
+              epoch_domain::guard g(epochs);
+              const version* v = published.load(std::memory_order_acquire);
+              for (int i = 0; i < 64; ++i) { x = x * 1103515245 + 12345;  hits += v->get((int)(x % n) + 1) != Value(); }
+            }
+            done += 64;
+          }
+          reads += done;
+          found += hits;
+        });
+      }
+      std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+      stop = true;
+      writer.join();
+      for (std::thread& t : rs) { t.join(); }
+      delete published.load();
+      std::cout << "  " << (mode == 0 ? "single mutex:      " : "persistent version:")
+                << "  reads/s " << std::setw(10) << (long)(reads / seconds)
+                << "  writes/s " << std::setw(9) << (long)(writes / seconds) << "\n";
+    }
+  }
+};
+
+
+#endif /* bst_persistent_h */
@@ -1,21 +1,105 @@
+#ifndef bst_redblack_h
+#define bst_redblack_h
+
 #include <iostream>
+#include <iomanip>
 #include <fstream>
+#include <cstring>
 #include <cassert>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <memory>
+#include <utility>
 #include "queue.h"
 #include "utils.h"
+#include "node_arena.h"
+#include "aggregate.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "frozen_st.h"
+#include "st_snapshot.h"
 
 //this is a left-leaning red-black tree
-template <typename Key, typename Value>
+//nodes come from the Alloc policy (see node_arena.h); the default arena
+//recycles deleted nodes and frees the whole tree in O(chunks).
+//trees produced by split() share one allocator, so they must not be
+//modified from different threads at the same time.
+//Compare is a three-way policy (see three_way in utils.h): comp(a, b) is
+//< 0, 0 or > 0, so each node on a search path costs one inlined call.
+//Aggregate is a monoid kept per subtree next to size (see aggregate.h)
+//Stats receives the instrumentation hooks (see stats.h); no_stats costs nothing
+template <typename Key, typename Value, template <typename> class Alloc = node_arena,
+          typename Compare = three_way<Key>, typename Aggregate = no_aggregate,
+          typename Stats = no_stats>
 class bst_redblack {
 	
 	public:
-		bst_redblack() : root(nullptr) { }
+		explicit bst_redblack(const Compare& comp_ = Compare())
+		: root(nullptr), alloc(std::make_shared<Alloc<Node>>()), comp(comp_) { }
+
+		bst_redblack(bst_redblack&& other)
+		: root(other.root), alloc(std::move(other.alloc)), comp(other.comp), stats_(other.stats_),
+		  finger_(std::move(other.finger_))
+		{
+			other.root = nullptr;
+			other.alloc = std::make_shared<Alloc<Node>>();
+		}
+
+		bst_redblack& operator=(bst_redblack&& other)
+		{
+			if(this != &other)
+			{
+				clear();
+				std::swap(alloc, other.alloc);
+				comp = other.comp;
+				stats_ = other.stats_;
+				finger_ = std::move(other.finger_);
+				root = other.root;
+				other.root = nullptr;
+			}
+			return *this;
+		}
+
+		bst_redblack(const bst_redblack&) = delete;
+		bst_redblack& operator=(const bst_redblack&) = delete;
+
+		~bst_redblack()
+		{
+			clear();
+		}
+
+		//removes every node; with a bulk-release allocator that no other tree
+		//shares and trivially destructible keys/values this is O(chunks)
+		void clear()
+		{
+			if(Alloc<Node>::bulk_release && alloc.use_count() == 1)
+			{
+				if(!std::is_trivially_destructible<Node>::value)
+				{
+					destroy(root, false);
+				}
+				alloc->release();
+			} else {
+				destroy(root, true);
+			}
+			root = nullptr;
+		}
 
 	private:
 		static const bool RED = true;
 		static const bool BLACK = false;
 
-		struct Node 
+		//sizes are ints, so n < 2^31 and the height of an LLRB is at most
+		//2 lg n; this bounds the explicit path stacks used instead of recursion
+		static const int MAX_DEPTH = 2 * 32;
+
+		static const bool AUGMENTED = !std::is_same<Aggregate, no_aggregate>::value;
+
+		struct Node : aggregate_slot<Aggregate>
 		{
 			Key key;
 			Value val;
@@ -23,8 +107,11 @@ class bst_redblack {
 			bool color;
 			int size;
 
-			Node(Key key_, Value val_, int size_)
-	    	: key(key_), val(val_), size(size_), left(nullptr), right(nullptr) {
+			//key and value are built in place from k and args
+			template <typename K, typename... Args>
+			Node(bool color_, K&& k, Args&&... args)
+	    	: key(std::forward<K>(k)), val(std::forward<Args>(args)...), left(nullptr), right(nullptr),
+	    	  color(color_), size(1) {
 	    	}
 
 		    friend std::ostream& operator<<(std::ostream& os, const Node& no) {
@@ -35,11 +122,64 @@ class bst_redblack {
 		};
 
 		Node* root;
+		std::shared_ptr<Alloc<Node>> alloc;
+		Compare comp;
+		mutable Stats stats_;
+
+		//every key comparison goes through here so Stats can count it
+		template <typename A, typename B>
+		int compare_keys(const A& a, const B& b) const
+		{
+			stats_.compared();
+			return comp(a, b);
+		}
+
+		//Node allocation; the key is built from k and the value from args
+		template <typename K, typename... Args>
+		Node* new_node(K&& k, Args&&... args)
+		{
+			Node* n = alloc->allocate();
+			stats_.allocated();
+			try {
+				new (n) Node(RED, std::forward<K>(k), std::forward<Args>(args)...);
+			} catch (...) {
+				alloc->deallocate(n);
+				throw;
+			}
+			if constexpr (AUGMENTED)
+			{
+				n->agg = Aggregate::lift(n->key, n->val);
+			}
+			return n;
+		}
+
+		void free_node(Node* n)
+		{
+			n->~Node();
+			alloc->deallocate(n);
+			stats_.freed();
+		}
+
+		//runs destructors over a subtree, handing storage back if recycle is set
+		void destroy(Node* x, bool recycle)
+		{
+			if(x == nullptr)
+			{
+				return;
+			}
+			destroy(x->left, recycle);
+			destroy(x->right, recycle);
+			x->~Node();
+			if(recycle)
+			{
+				alloc->deallocate(x);
+			}
+		}
 
 		//Node helper functions
 		bool is_red(Node* n) 
 		{
-			return (n == nullptr ? false : n == nullptr);
+			return (n == nullptr ? false : n->color == RED);
 		}
 
 		int size(Node* n)
@@ -51,6 +191,37 @@ class bst_redblack {
 			return n->size;
 		}
 
+		typename Aggregate::type agg(Node* n)
+		{
+			return n == nullptr ? Aggregate::identity() : n->agg;
+		}
+
+		//recomputes h's size, and its aggregate, from its children
+		void pull(Node* h)
+		{
+			h->size = size(h->left) + size(h->right) + 1;
+			if constexpr (AUGMENTED)
+			{
+				h->agg = Aggregate::combine(Aggregate::combine(agg(h->left), Aggregate::lift(h->key, h->val)),
+				                            agg(h->right));
+			}
+		}
+
+		//pulls the nodes behind path[d - 1], ..., path[0], bottom-up
+		void pull_path(Node** path[], int d)
+		{
+			while(d > 0)
+			{
+				pull(*path[--d]);
+			}
+		}
+
+	public:
+		static size_t bytes_per_node()
+		{
+			return sizeof(Node);
+		}
+
 		int size()
 		{
 			return size(root);
@@ -65,39 +236,138 @@ class bst_redblack {
 	 * standard BST search
 	 ***********************/
 	public: 
-		Value get(Key k)
+		Value get(const Key& k)
+		{
+			if(k == Key())
+			{
+				throw new std::invalid_argument("argument to get() is null");
+			}
+			return get(root, k);
+		}
+
+		//lookup by any type Compare accepts next to Key, e.g. std::string_view
+		//or const char* for std::string keys, without building a Key
+		template <typename K, typename C = Compare, typename = typename C::is_transparent>
+		Value get(const K& k)
 		{
 			if(k == Key())
 			{
-				throw new std::invalid_argument("argument to contains() is null");
+				throw new std::invalid_argument("argument to get() is null");
 			}
-			return get(root,k);
+			return get(root, k);
 		}
 
 	private:
-		Value get(Node* x, Key k)
+		template <typename K>
+		Value get(Node* x, const K& k)
 		{
+			int depth = 0;
 			while(x != nullptr)
 			{
-				//bool less = (k < x->key ? true : false);
-				const fwd_comparator<Key> comp;
-				int cmp = compare(k, x->key, &comp);
-				if(cmp < 0){
-					x = x->left;
-				} else if (cmp > 0) {
-					x = x->right;
-				} else {
+				stats_.visited();
+				++depth;
+				int cmp = compare_keys(k, x->key);
+				if(cmp == 0)
+				{
+					stats_.looked_up(depth);
 					return x->val;
 				}
-
+				//a select rather than a branch, so it can compile to a cmov
+				x = (cmp < 0 ? x->left : x->right);
 			}
-			//return null;
+			stats_.looked_up(depth);
+			return Value();
+		}
+
+	public:
+		bool contains(const Key& k)
+		{
+			return get(k) != Value();
 		}
 
+		template <typename K, typename C = Compare, typename = typename C::is_transparent>
+		bool contains(const K& k)
+		{
+			return get(k) != Value();
+		}
+
+	/***********************************************************************
+	 * Batched lookup
+	 *
+	 * Up to GET_MANY_LANES searches advance in lockstep, one level each per
+	 * round, and each prefetches the node it will visit next before the
+	 * other lanes run. The cache misses of independent lookups then overlap
+	 * instead of being paid one after another. A lane that finishes takes
+	 * the next key right away, so short and long searches mix freely.
+	 ***********************************************************************/
 	public:
-		bool contains(Key k)
+		static const int GET_MANY_LANES = 16;
+
+		//out[i] = get(keys[i]); out is resized to keys.size()
+		void get_many(const std::vector<Key>& keys, std::vector<Value>& out)
+		{
+			size_t n = keys.size();
+			out.assign(n, Value());
+
+			Node* at[GET_MANY_LANES];
+			size_t job[GET_MANY_LANES];
+			int lanes = 0;
+			size_t next = 0;
+			for(; lanes < GET_MANY_LANES && next < n; ++lanes, ++next)
+			{
+				at[lanes] = root;
+				job[lanes] = next;
+			}
+			prefetch(root);
+
+			while(lanes > 0)
+			{
+				for(int i = 0; i < lanes; )
+				{
+					Node* x = at[i];
+					const Key& k = keys[job[i]];
+					bool done = (x == nullptr);
+					if(!done)
+					{
+						stats_.visited();
+						int cmp = compare_keys(k, x->key);
+						if(cmp < 0) {
+							x = x->left;
+						} else if(cmp > 0) {
+							x = x->right;
+						} else {
+							out[job[i]] = x->val;
+							done = true;
+						}
+					}
+					if(!done)
+					{
+						prefetch(x);
+						at[i++] = x;
+					} else if(next < n) {
+						at[i] = root;
+						job[i++] = next++;
+					} else {
+						//retire the lane by moving the last one into its place
+						--lanes;
+						at[i] = at[lanes];
+						job[i] = job[lanes];
+					}
+				}
+			}
+		}
+
+	private:
+		static void prefetch(const Node* x)
 		{
-			return get(k) != nullptr;
+#if defined(__GNUC__) || defined(__clang__)
+			if(x != nullptr)
+			{
+				__builtin_prefetch(x);
+			}
+#else
+			(void)x;
+#endif
 		}
 
 	/***************************
@@ -105,7 +375,103 @@ class bst_redblack {
 	 ***************************/
 
 	public:
-		void put(Key k, Value v)
+		void put(const Key& k, const Value& v)
+		{
+			put_(k, v);
+		}
+
+		void put(Key&& k, Value&& v)
+		{
+			put_(std::move(k), std::move(v));
+		}
+
+		//inserts k with a value built in place from args if k is absent, and
+		//leaves an existing entry alone; returns whether k was inserted. As
+		//with put(), a value equal to Value() is not stored
+		template <typename... Args>
+		bool try_emplace(const Key& k, Args&&... args)
+		{
+			return emplace_(k, std::forward<Args>(args)...);
+		}
+
+		template <typename... Args>
+		bool try_emplace(Key&& k, Args&&... args)
+		{
+			return emplace_(std::move(k), std::forward<Args>(args)...);
+		}
+
+		//with a transparent Compare the Key is built from k only on insertion
+		template <typename K, typename... Args, typename C = Compare, typename = typename C::is_transparent>
+		bool try_emplace(const K& k, Args&&... args)
+		{
+			return emplace_(k, std::forward<Args>(args)...);
+		}
+
+		//creates or updates the value of k in a single pass: fn(v) edits the
+		//stored value in place, and a new key starts from Value(), so word
+		//counting is upsert(word, [](int& n) { ++n; }). A value left equal to
+		//Value() is not stored: an existing key is then unlinked from the path
+		//just searched, bottom-up, without a second descent. Returns whether k
+		//was inserted
+		template <typename F>
+		bool upsert(const Key& k, F fn)
+		{
+			return upsert_(k, fn);
+		}
+
+		template <typename F>
+		bool upsert(Key&& k, F fn)
+		{
+			return upsert_(std::move(k), fn);
+		}
+
+		template <typename K, typename F, typename C = Compare, typename = typename C::is_transparent>
+		bool upsert(const K& k, F fn)
+		{
+			return upsert_(k, fn);
+		}
+
+	private:
+		template <typename K, typename F>
+		bool upsert_(K&& k, F& fn)
+		{
+			if(k == Key())
+			{
+				throw new std::invalid_argument("first arguement to upsert() is null");
+			}
+
+			Node** path[MAX_DEPTH];
+			int d = 0;
+			Node** link = find_link(k, path, d);
+			if(*link != nullptr)
+			{
+				Node* x = *link;
+				fn(x->val);
+				if(x->val == Value())
+				{
+					remove_at(path, d, link);
+					return false;
+				}
+				if constexpr (AUGMENTED)
+				{
+					pull(x);
+					pull_path(path, d);
+				}
+				return false;
+			}
+			Value v = Value();
+			fn(v);
+			if(v == Value())
+			{
+				return false;
+			}
+			*link = new_node(std::forward<K>(k), std::move(v));
+			fix_insert(path, d);
+			return true;
+		}
+
+		template <typename K, typename V>
+		void put_(K&& k, V&& v)
 		{
 			if(k == Key())
 			{
@@ -116,49 +482,234 @@ class bst_redblack {
 				delete_(k);
 				return;
 			}
+			if(finger_ != nullptr)
+			{
+				put_with_finger(std::forward<K>(k), std::forward<V>(v));
+				return;
+			}
 
-			root = put(root,k,v);
-			root->color = BLACK;
+			Node** path[MAX_DEPTH];
+			int d = 0;
+			Node** link = find_link(k, path, d);
+			if(*link != nullptr)
+			{
+				(*link)->val = std::forward<V>(v);
+				if constexpr (AUGMENTED)
+				{
+					pull(*link);
+					pull_path(path, d);
+				}
+				return;
+			}
+			*link = new_node(std::forward<K>(k), std::forward<V>(v));
+			fix_insert(path, d);
 		}
 
-	private:
-		Node* put(Node* h, Key k, Value v)
+		template <typename K, typename... Args>
+		bool emplace_(K&& k, Args&&... args)
+		{
+			if(k == Key())
+			{
+				throw new std::invalid_argument("first arguement to try_emplace() is null");
+			}
+
+			Node** path[MAX_DEPTH];
+			int d = 0;
+			Node** link = find_link(k, path, d);
+			if(*link != nullptr)
+			{
+				return false;
+			}
+			Node* x = new_node(std::forward<K>(k), std::forward<Args>(args)...);
+			if(x->val == Value())
+			{
+				free_node(x);
+				return false;
+			}
+			*link = x;
+			fix_insert(path, d);
+			return true;
+		}
+
+		//walks down from the root recording the links we pass through; returns
+		//the link holding k, or the empty link where k belongs
+		template <typename K>
+		Node** find_link(const K& k, Node** path[], int& d)
 		{
-			if(h == nullptr)
+			Node** link = &root;
+			while(*link != nullptr)
 			{
-				return new Node(k, v, RED, 1);
+				Node* h = *link;
+				stats_.visited();
+				int cmp = compare_keys(k, h->key);
+				if(cmp == 0)
+				{
+					stats_.looked_up(d + 1);
+					return link;
+				}
+				assert(d < MAX_DEPTH);
+				path[d++] = link;
+				link = (cmp < 0 ? &h->left : &h->right);
 			}
+			stats_.looked_up(d);
+			return link;
+		}
 
-			//TODO: change to compare(T& v, T& w, const comparator<T>& comp) from utils.h
-			//bool less = (k < h->key ? true : false);
-			const fwd_comparator<Key> comp;
-			int cmp = compare(k, h->key, &comp);
-			if(cmp < 0){
-				h->left = put(h->right, k, v);
-			} else if (cmp > 0){
-				h->right = put(h->right, k, v);
+		//rebalances bottom-up along the path of a new leaf. Once a subtree
+		//keeps the same black root nothing above it can see a difference, so
+		//the rest of the path only needs its size bumped (and its aggregate
+		//recomputed). Returns the depth of that subtree's root (0 if the
+		//rebalancing reached the root): the nodes at path[0..depth] are the
+		//same as before the insertion
+		int fix_insert(Node** path[], int d)
+		{
+			while(d > 0)
+			{
+				Node** l = path[--d];
+				Node* h = *l;
+				bool was_red = is_red(h);
+				*l = fix_up(h);
+				if(*l == h && !was_red && !is_red(h))
+				{
+					break;
+				}
+			}
+			int stop = d;
+			if constexpr (AUGMENTED)
+			{
+				pull_path(path, d);
 			} else {
-				h->val = v;
+				while(d > 0)
+				{
+					(*path[--d])->size++;
+				}
 			}
+			root->color = BLACK;
+			return stop;
+		}
 
+	private:
+		//restores the left-leaning invariants at h after an insertion below it
+		Node* fix_up(Node* h)
+		{
 			if(is_red(h->right) && !is_red(h->left))
 			{
 				h = rotate_left(h);
 			}
-			if(is_red(h->left) && !is_red(h->left->left))
+			if(is_red(h->left) && is_red(h->left->left))
 			{
-				h = rotate_left(h);
+				h = rotate_right(h);
 			}
-			//check if this is in the correct part of the code
-			if(is_red(h->left) && !is_red(h->right))
+			if(is_red(h->left) && is_red(h->right))
 			{
 				flip_colors(h);
 			}
-			h->size = size(h->left) + size(h->right) + 1;
+			pull(h);
 
 			return h;
 		}
 
+	/***********************************************************************
+	 * Bulk load from a sorted range of (key, value) pairs in O(n)
+	 *
+	 * Duplicate keys keep the last value and pairs whose final value is
+	 * Value() are skipped, as put() would. The tree gets the largest black
+	 * height floor(lg(n+1)); each subtree is a 2-node when its children can
+	 * hold the keys and a 3-node (black node with a red left child) when
+	 * they can't, so the red links end up near the bottom.
+	 ***********************************************************************/
+	public:
+		template <typename It>
+		static bst_redblack build_from_sorted(It first, It last, const Compare& comp = Compare())
+		{
+			int n = 0;
+			for(It it = first; it != last; )
+			{
+				It run = next_run(it, last, comp);
+				if(!(run->second == Value()))
+				{
+					++n;
+				}
+			}
+
+			int bh = 0;
+			while((2LL << bh) - 1 <= n)
+			{
+				++bh;
+			}
+
+			bst_redblack st(comp);
+			It it = first;
+			st.root = st.build_sorted(it, last, n, bh);
+			return st;
+		}
+
+	private:
+		//moves it past a run of equal keys and returns the run's last element
+		template <typename It>
+		static It next_run(It& it, It last, const Compare& comp)
+		{
+			It run = it;
+			++it;
+			while(it != last && comp(run->first, it->first) >= 0)
+			{
+				run = it;
+				++it;
+			}
+			return run;
+		}
+
+		template <typename It>
+		Node* take_sorted(It& it, It last, bool color)
+		{
+			It run = next_run(it, last, comp);
+			while(run->second == Value())
+			{
+				run = next_run(it, last, comp);
+			}
+			Node* x = new_node(run->first, run->second);
+			x->color = color;
+			return x;
+		}
+
+		//builds s nodes with black height bh, 2^bh - 1 <= s <= 3^bh - 1
+		template <typename It>
+		Node* build_sorted(It& it, It last, int s, int bh)
+		{
+			if(s == 0)
+			{
+				return nullptr;
+			}
+			long long cap = 1;    //most keys a child of black height bh - 1 can hold
+			for(int i = 1; i < bh; ++i)
+			{
+				cap *= 3;
+			}
+			cap -= 1;
+
+			Node* x;
+			if(s - 1 <= 2 * cap)
+			{
+				int rs = (s - 1) / 2;
+				Node* l = build_sorted(it, last, s - 1 - rs, bh - 1);
+				x = take_sorted(it, last, BLACK);
+				x->left = l;
+				x->right = build_sorted(it, last, rs, bh - 1);
+			} else {
+				int rest = s - 2;
+				Node* a = build_sorted(it, last, (rest + 2) / 3, bh - 1);
+				Node* r = take_sorted(it, last, RED);
+				r->left = a;
+				r->right = build_sorted(it, last, (rest + 1) / 3, bh - 1);
+				pull(r);
+				x = take_sorted(it, last, BLACK);
+				x->left = r;
+				x->right = build_sorted(it, last, rest / 3, bh - 1);
+			}
+			pull(x);
+			return x;
+		}
+
 	/**************************
 	 * Red-black tree deletion
 	 **************************/
@@ -170,13 +721,14 @@ class bst_redblack {
 				throw new std::logic_error("BST underflow");
 			}
 
-			//if both children of root are black, set root to end
+			//if both children of root are black, set root to red
 			if(!is_red(root->left) && !is_red(root->right))
 			{
 				root->color = RED;
 			}
 
-			root = delete_min(root);
+			Node** path[MAX_DEPTH];
+			free_node(delete_min(&root, path, 0));
 			if(!is_empty())
 			{
 				root->color = BLACK;
@@ -184,20 +736,42 @@ class bst_redblack {
 		}
 
 	private:
-		Node* delete_min(Node* h)
+		//unlinks the minimum of the subtree hanging off link and returns it
+		//(still allocated); path[0..d) are the links already walked above it,
+		//and all of them get rebalanced
+		Node* delete_min(Node** link, Node** path[], int d)
 		{
-			if(h->left == nullptr)
+			Node* detached;
+			while(true)
 			{
-				return nullptr; //&Node()
+				Node* h = *link;
+				if(h->left == nullptr)
+				{
+					detached = h;
+					*link = nullptr;
+					break;
+				}
+
+				if(!is_red(h->left) && !is_red(h->left->left))
+				{
+					h = move_red_left(h);
+					*link = h;
+				}
+				assert(d < MAX_DEPTH);
+				path[d++] = link;
+				link = &h->left;
 			}
+			rebalance(path, d);
+			return detached;
+		}
 
-			if(!is_red(h->left) && !is_red(h->left->left))
+		void rebalance(Node** path[], int d)
+		{
+			while(d > 0)
 			{
-				h = moveedLeft(h);
+				Node** l = path[--d];
+				*l = balance(*l);
 			}
-
-			h->left = delete_min(h->left);
-			return balance(h);
 		}
 
 	/**********************************************************************
@@ -211,57 +785,79 @@ class bst_redblack {
 				throw new std::logic_error("BST underflow");
 			}
 
-			//if both children of root are black, set root to end
+			//if both children of root are black, set root to red
 			if(!is_red(root->left) && !is_red(root->right))
 			{
 				root->color = RED;
 			}
 
-			root = delete_min(root);
+			Node** path[MAX_DEPTH];
+			int d = 0;
+			Node** link = &root;
+			while(true)
+			{
+				Node* h = *link;
+				if(is_red(h->left))
+				{
+					h = rotate_right(h);
+					*link = h;
+				}
+				if(h->right == nullptr)
+				{
+					free_node(h);
+					*link = nullptr;
+					break;
+				}
+				if(!is_red(h->right) && !is_red(h->right->left))
+				{
+					h = move_red_right(h);
+					*link = h;
+				}
+				assert(d < MAX_DEPTH);
+				path[d++] = link;
+				link = &h->right;
+			}
+			rebalance(path, d);
+
 			if(!is_empty())
 			{
 				root->color = BLACK;
 			}
 		}
 
-	private:
-		Node* delete_max(Node* h)
-		{
-			if (is_red(h->left))
-        	h = rotate_right(h);
-
-        	if (h->right == nullptr)
-        	{
-        		return nullptr; //&Node()
-        	}
-            
-			if (!is_red(h->right) && !is_red(h->right->left))
-            {
-            	h = move_red_right(h);
-            }
-
-        	h->right = delete_max(h->right);
-
-        	return balance(h);
-		}
-
 	/****************************************************************************
 	 * Removes the specified key and its associated value from this symbol table     
      * (if the key is in this symbol table)
 	 ****************************************************************************/
 
 	public:
-		void delete_(Key k) 
+		//one top-down pass: the search and the restructuring that makes room
+		//for the removal happen together. If k turns out to be absent, the
+		//rebalancing on the way back up undoes those transformations, so the
+		//tree is walked once either way. Returns whether k was found
+		bool delete_(const Key& k)
+		{
+			return delete_key(k);
+		}
+
+		template <typename K, typename C = Compare, typename = typename C::is_transparent>
+		bool delete_(const K& k)
+		{
+			return delete_key(k);
+		}
+
+	private:
+		template <typename K>
+		bool delete_key(const K& k)
 		{ 
 	        if (k == Key())
 			{
 				throw new std::invalid_argument("argument to delete_() is null");
 			}
-
-	        if (!contains(k))
-        	{
-        		return;
-        	}
+	        if (is_empty())
+	        {
+	            return false;
+	        }
 
 	        // if both children of root are black, set root to red
 	        if (!is_red(root->left) && !is_red(root->right))
@@ -269,61 +865,705 @@ class bst_redblack {
 	            root->color = RED;
 	        }
 
-	        root = delete_(root, k);
-	        if (!is_empty()) root->color = BLACK;
-        // assert check();
-    	}
-
-    // delete the key-value pair with the given key rooted at h
-    private:
-    	Node* delete_(Node* h, Key k) { 
-	        // assert get(h, key) != null;
-	        //replaces "(key->compareTo(h->key)"
-	    	int temp = (k < h->key ? -1 : 1);
-	    	if (k == h->key)
-	    	{
-	    		temp = 0;
-	    	}
+	        Node** path[MAX_DEPTH];
+	        int d = 0;
+	        Node** link = &root;
+	        bool found = false;
+	        while (true)
+	        {
+	            Node* h = *link;
+	            stats_.visited();
+	            int cmp = compare_keys(k, h->key);
+	            if (cmp < 0) {
+	                if (h->left == nullptr) {
+	                    break;
+	                }
+	                if (!is_red(h->left) && !is_red(h->left->left)) {
+	                    h = move_red_left(h);
+	                    *link = h;
+	                }
+	                assert(d < MAX_DEPTH);
+	                path[d++] = link;
+	                link = &h->left;
+	                continue;
+	            }
 
-	        if (temp < 0)  {
-	            if (!is_red(h->left) && !is_red(h->left->left))
-	                h = move_red_left(h);
-	            h->left = delete_(h->left, k);
-	        } else {
-	            if (is_red(h->left))
+	            if (is_red(h->left)) {
 	                h = rotate_right(h);
-	            if (temp == 0 && (h->right == nullptr))
-	                return nullptr; //&Node()
-	            if (!is_red(h->right) && !is_red(h->right->left))
+	                *link = h;
+	                cmp = compare_keys(k, h->key);
+	            }
+	            if (h->right == nullptr) {
+	                if (cmp == 0) {
+	                    free_node(h);
+	                    *link = nullptr;
+	                    found = true;
+	                }
+	                break;
+	            }
+	            if (!is_red(h->right) && !is_red(h->right->left)) {
 	                h = move_red_right(h);
-	            if (temp == 0) {
-	                Node x = min(h->right);
+	                *link = h;
+	                cmp = compare_keys(k, h->key);
+	            }
+	            assert(d < MAX_DEPTH);
+	            path[d++] = link;
+	            if (cmp == 0) {
+	                // replace h by its successor, then delete the successor
+	                Node* x = min(h->right);
 	                h->key = x->key;
 	                h->val = x->val;
-	                // h->val = get(h->right, min(h->right)->key);
-	                // h->key = min(h->right)->key;
-	                h->right = delete_min(h->right);
+	                free_node(delete_min(&h->right, path, d));
+	                found = true;
+	                d = 0;                  // delete_min() rebalanced the path
+	                break;
 	            }
-	            else h->right = delete_(h->right, k);
+	            link = &h->right;
 	        }
-	        return balance(h);
-	    }
+	        rebalance(path, d);
 
-    /***********************
-	 * Red-black tree helper functions
-	 ***********************/
+	        if (!is_empty()) root->color = BLACK;
+	        return found;
+    	}
 
-    // make a left-leaning link lean to the right
-    private:
-    	Node* rotate_right(Node* h) {
-	        // assert (h != null) && is_red(h->left);
-	        Node x = h->left;
-	        h->left = x->right;
-	        x->right = h;
-	        x->color = x->right->color;
-	        x->right->color = RED;
-	        x->size = h->size;
-	        h->size = size(h->left) + size(h->right) + 1;
+		//removes the node at *link, the links above it being path[0..d), from
+		//the bottom up: nothing is searched for again. In 2-3 tree terms the
+		//node that goes (x itself, or the successor that takes x's place)
+		//sits in a bottom 2-3 node. Out of a 3-node that is the end of it;
+		//out of a 2-node it leaves a hole one black link short, which is
+		//filled from an adjacent 3-node sibling, or else merged into the
+		//parent and handed up when the parent was a 2-node as well
+		void remove_at(Node** path[], int d, Node** link)
+		{
+			Node* x = *link;
+			if(x->right != nullptr)
+			{
+				assert(d < MAX_DEPTH);
+				path[d++] = link;
+				link = &x->right;
+				while((*link)->left != nullptr)
+				{
+					assert(d < MAX_DEPTH);
+					path[d++] = link;
+					link = &(*link)->left;
+				}
+				x->key = std::move((*link)->key);
+				x->val = std::move((*link)->val);
+			}
+
+			//at most a red leaf hangs off the node that goes
+			Node* y = *link;
+			bool hole = !is_red(y) && y->left == nullptr;
+			if(y->left != nullptr)
+			{
+				y->left->color = BLACK;
+			}
+			*link = y->left;
+			free_node(y);
+
+			while(hole && d > 0)
+			{
+				Node** up = path[--d];
+				*up = fill(*up, link == &(*up)->left, hole);
+				link = up;
+			}
+			pull_path(path, d);
+
+			if(!is_empty())
+			{
+				root->color = BLACK;
+			}
+		}
+
+		//q's subtree on the hole side is one black link short. Fixes it with
+		//a rotation where a sibling can spare a key, and otherwise merges;
+		//hole stays set only if all of q's subtree is now short
+		Node* fill(Node* q, bool left_hole, bool& hole)
+		{
+			hole = false;
+			if(left_hole)
+			{
+				Node* w = q->right;
+				if(is_red(w->left))
+				{
+					Node* t = w->left;
+					q->right = t->left;
+					w->left = t->right;
+					t->left = q;
+					t->right = w;
+					t->color = q->color;
+					q->color = BLACK;
+					pull(q);
+					pull(w);
+					pull(t);
+					return t;
+				}
+				hole = !is_red(q);
+				q->right = w->left;
+				w->left = q;
+				q->color = RED;
+				pull(q);
+				pull(w);
+				return w;
+			}
+
+			if(is_red(q->left))
+			{
+				//q closes a 3-node; its middle child s is the sibling
+				Node* l = q->left;
+				Node* s = l->right;
+				if(is_red(s->left))
+				{
+					s->left->color = BLACK;
+					l->right = s->left;
+					q->left = s->right;
+					s->left = l;
+					s->right = q;
+					s->color = BLACK;
+					pull(l);
+					pull(q);
+					pull(s);
+					return s;
+				}
+				l->right = q;
+				q->left = s;
+				s->color = RED;
+				l->color = BLACK;
+				pull(q);
+				pull(l);
+				return l;
+			}
+
+			Node* w = q->left;
+			if(is_red(w->left))
+			{
+				w->left->color = BLACK;
+				q->left = w->right;
+				w->right = q;
+				w->color = q->color;
+				q->color = BLACK;
+				pull(q);
+				pull(w);
+				return w;
+			}
+			hole = !is_red(q);
+			w->color = RED;
+			q->color = BLACK;
+			pull(q);
+			return q;
+		}
+
+	/***********************************************************************
+	 * Split and join in O(log n)
+	 *
+	 * Pieces are matched by black height, so nodes are relinked rather than
+	 * copied and every size field stays correct for rank/select. A tree is
+	 * passed around as a black-rooted piece together with its black height.
+	 ***********************************************************************/
+	public:
+		//empties this tree; first holds the keys < k, second the keys >= k.
+		//both pieces keep sharing this tree's allocator
+		std::pair<bst_redblack, bst_redblack> split(const Key& k)
+		{
+			piece lt, ge;
+			Node* eq = split(root, black_height(root), k, lt, ge);
+			if(eq != nullptr)
+			{
+				ge = join(piece(), eq, ge);
+			}
+			root = nullptr;
+
+			std::pair<bst_redblack, bst_redblack> result{bst_redblack(comp), bst_redblack(comp)};
+			result.first.alloc = alloc;
+			result.first.root = lt.root;
+			result.second.alloc = alloc;
+			result.second.root = ge.root;
+			return result;
+		}
+
+		//every key in left must be smaller than every key in right
+		static bst_redblack join(bst_redblack&& left, bst_redblack&& right)
+		{
+			if(right.is_empty())
+			{
+				return std::move(left);
+			}
+			if(left.is_empty())
+			{
+				return std::move(right);
+			}
+			check_join_order(left, right);
+			left.adopt(right);
+
+			piece joined = left.join(piece(left.root, left.black_height(left.root)),
+			                         piece(right.root, right.black_height(right.root)));
+			left.root = joined.root;
+			right.root = nullptr;
+			return std::move(left);
+		}
+
+		//every key in left must be smaller than k, and k smaller than every key in right
+		static bst_redblack join(bst_redblack&& left, const Key& k, const Value& v, bst_redblack&& right)
+		{
+			if(!left.is_empty() && left.compare_keys(left.max(left.root)->key, k) >= 0)
+			{
+				throw new std::invalid_argument("join() key is not greater than the left tree");
+			}
+			if(!right.is_empty() && left.compare_keys(k, right.min(right.root)->key) >= 0)
+			{
+				throw new std::invalid_argument("join() key is not less than the right tree");
+			}
+			left.adopt(right);
+
+			piece joined = left.join(piece(left.root, left.black_height(left.root)), left.new_node(k, v),
+			                         piece(right.root, right.black_height(right.root)));
+			left.root = joined.root;
+			right.root = nullptr;
+			return std::move(left);
+		}
+
+	private:
+		struct piece
+		{
+			Node* root;
+			int bh;
+
+			piece() : root(nullptr), bh(0) { }
+			piece(Node* root_, int bh_) : root(root_), bh(bh_) { }
+		};
+
+		static void check_join_order(bst_redblack& left, bst_redblack& right)
+		{
+			if(left.compare_keys(left.max(left.root)->key, right.min(right.root)->key) >= 0)
+			{
+				throw new std::invalid_argument("join() needs every left key below every right key");
+			}
+		}
+
+		//makes other's nodes belong to this tree's allocator
+		void adopt(bst_redblack& other)
+		{
+			if(alloc == other.alloc)
+			{
+				return;
+			}
+			if(other.alloc.use_count() == 1)
+			{
+				alloc->merge(*other.alloc);
+				other.alloc = alloc;
+			} else if(alloc.use_count() == 1) {
+				other.alloc->merge(*alloc);
+				alloc = other.alloc;
+			} else {
+				//both allocators are shared with other trees, so neither can be
+				//handed over: copy other's nodes instead (O(size of other))
+				Node* copy = clone(other.root);
+				other.destroy(other.root, true);
+				other.root = copy;
+				other.alloc = alloc;
+			}
+		}
+
+		Node* clone(Node* x)
+		{
+			if(x == nullptr)
+			{
+				return nullptr;
+			}
+			Node* c = new_node(x->key, x->val);
+			c->color = x->color;
+			c->left = clone(x->left);
+			c->right = clone(x->right);
+			pull(c);
+			return c;
+		}
+
+		//number of black nodes on any path from x down to a null link
+		int black_height(Node* x)
+		{
+			int bh = 0;
+			for( ; x != nullptr; x = x->left)
+			{
+				if(!is_red(x))
+				{
+					++bh;
+				}
+			}
+			return bh;
+		}
+
+		piece blacken(Node* x, int bh)
+		{
+			if(is_red(x))
+			{
+				x->color = BLACK;
+				++bh;
+			}
+			return piece(x, bh);
+		}
+
+		//l < r without a middle node: the minimum of r takes that role
+		piece join(piece l, piece r)
+		{
+			if(r.root == nullptr)
+			{
+				return l;
+			}
+			if(l.root == nullptr)
+			{
+				return r;
+			}
+			if(!is_red(r.root->left) && !is_red(r.root->right))
+			{
+				r.root->color = RED;
+			}
+			Node** path[MAX_DEPTH];
+			Node* m = delete_min(&r.root, path, 0);
+			if(r.root != nullptr)
+			{
+				r.root->color = BLACK;
+			}
+			r.bh = black_height(r.root);
+			return join(l, m, r);
+		}
+
+		//l < m < r, both pieces black-rooted
+		piece join(piece l, Node* m, piece r)
+		{
+			Node* t;
+			if(l.bh > r.bh)
+			{
+				t = join_right(l.root, l.bh, m, r.root, r.bh);
+			} else if(l.bh < r.bh) {
+				t = join_left(l.root, l.bh, m, r.root, r.bh);
+			} else {
+				t = link_red(l.root, m, r.root);
+			}
+			return blacken(t, std::max(l.bh, r.bh));
+		}
+
+		Node* link_red(Node* l, Node* m, Node* r)
+		{
+			m->left = l;
+			m->right = r;
+			m->color = RED;
+			pull(m);
+			return m;
+		}
+
+		//walks down the (all black) right spine of h to black height rb
+		Node* join_right(Node* h, int hb, Node* m, Node* r, int rb)
+		{
+			if(hb == rb && !is_red(h))
+			{
+				return link_red(h, m, r);
+			}
+			h->right = join_right(h->right, hb - (is_red(h) ? 0 : 1), m, r, rb);
+			return fix_up(h);
+		}
+
+		//walks down the left spine of h to black height lb
+		Node* join_left(Node* l, int lb, Node* m, Node* h, int hb)
+		{
+			if(hb == lb && !is_red(h))
+			{
+				return link_red(l, m, h);
+			}
+			h->left = join_left(l, lb, m, h->left, hb - (is_red(h) ? 0 : 1));
+			return fix_up(h);
+		}
+
+		//splits the subtree x of black height xb into keys < k and keys > k;
+		//returns the node holding k, unlinked, or nullptr
+		Node* split(Node* x, int xb, const Key& k, piece& lt, piece& gt)
+		{
+			if(x == nullptr)
+			{
+				lt = gt = piece();
+				return nullptr;
+			}
+			int cb = xb - (is_red(x) ? 0 : 1);
+			piece l = blacken(x->left, cb);
+			piece r = blacken(x->right, cb);
+
+			Node* eq;
+			int cmp = compare_keys(k, x->key);
+			if(cmp > 0)
+			{
+				piece a;
+				eq = split(r.root, r.bh, k, a, gt);
+				lt = join(l, x, a);
+			} else if(cmp < 0) {
+				piece b;
+				eq = split(l.root, l.bh, k, lt, b);
+				gt = join(b, x, r);
+			} else {
+				lt = l;
+				gt = r;
+				eq = x;
+				eq->left = eq->right = nullptr;
+				pull(eq);
+			}
+			return eq;
+		}
+
+	/***********************************************************************
+	 * Range deletion
+	 *
+	 * The keys in [low, high] are cut out with two splits and the rest is
+	 * joined back together, O(log n) relinking whatever the range holds;
+	 * the cut-out subtree then goes back to the allocator in a single walk
+	 * instead of one delete_() descent and rebalance per key.
+	 ***********************************************************************/
+	public:
+		//removes every key in [low, high]; returns how many there were
+		int delete_range(const Key& low, const Key& high)
+		{
+			return delete_range(low, high, [](const Key&, const Value&) { });
+		}
+
+		//as above, calling fn(key, value) on each removed entry, in key
+		//order, before its node is freed
+		template <typename F>
+		int delete_range(const Key& low, const Key& high, F fn)
+		{
+			if (low == Key())
+			{
+				throw new std::invalid_argument("first argument to delete_range() is null");
+			}
+			if (high == Key())
+			{
+				throw new std::invalid_argument("second argument to delete_range() is null");
+			}
+			if(is_empty() || compare_keys(low, high) > 0)
+			{
+				return 0;
+			}
+
+			piece lt, ge, in, gt;
+			Node* eq_low = split(root, black_height(root), low, lt, ge);
+			Node* eq_high = split(ge.root, ge.bh, high, in, gt);
+			root = join(lt, gt).root;
+			if(finger_ != nullptr)
+			{
+				*finger_ = finger();
+			}
+
+			int n = size(in.root) + (eq_low != nullptr) + (eq_high != nullptr);
+			drop(eq_low, fn);
+			drop(in.root, fn);
+			drop(eq_high, fn);
+			return n;
+		}
+
+	private:
+		//frees the subtree x in order, showing each entry to fn first
+		template <typename F>
+		void drop(Node* x, F& fn)
+		{
+			while(x != nullptr)
+			{
+				drop(x->left, fn);
+				fn(x->key, x->val);
+				Node* right = x->right;
+				free_node(x);
+				x = right;
+			}
+		}
+
+	/***********************************************************************
+	 * Set operations: union, intersection and difference
+	 *
+	 * Divide and conquer over split/join, O(m log(n/m + 1)) work for trees
+	 * of sizes m <= n. With a thread_pool the two halves of each step run in
+	 * parallel while the subproblem has at least SET_OP_CUTOFF keys; merge
+	 * (mine, theirs) -> Value is then called from several threads at once.
+	 * other is consumed; nodes that drop out are freed once all tasks finish.
+	 * If merge throws, the exception reaches the caller once every task has
+	 * finished, and both trees are left empty.
+	 ***********************************************************************/
+	public:
+		static const int SET_OP_CUTOFF = 4096;
+
+		//keys in either tree; values of common keys are merge(this, other)
+		template <typename Merge>
+		void union_with(bst_redblack&& other, Merge merge, thread_pool* pool = nullptr)
+		{
+			set_op(other, [&](piece a, piece b, std::vector<Node*>& dropped) {
+				return union_(a, b, merge, pool, dropped);
+			});
+		}
+
+		//keys in both trees, with values merge(this, other)
+		template <typename Merge>
+		void intersect_with(bst_redblack&& other, Merge merge, thread_pool* pool = nullptr)
+		{
+			set_op(other, [&](piece a, piece b, std::vector<Node*>& dropped) {
+				return intersect_(a, b, merge, pool, dropped);
+			});
+		}
+
+		//keys of this tree that are not in other
+		void difference(bst_redblack&& other, thread_pool* pool = nullptr)
+		{
+			set_op(other, [&](piece a, piece b, std::vector<Node*>& dropped) {
+				return difference_(a, b, pool, dropped);
+			});
+		}
+
+	private:
+		template <typename Op>
+		void set_op(bst_redblack& other, Op op)
+		{
+			if(this == &other)
+			{
+				throw new std::invalid_argument("set operation of a tree with itself");
+			}
+			adopt(other);
+			std::vector<Node*> dropped;
+			piece p;
+			try
+			{
+				p = op(piece(root, black_height(root)), piece(other.root, other.black_height(other.root)), dropped);
+			} catch(...) {
+				//the two trees are half relinked into each other: neither can
+				//be walked, so both are left empty and their nodes abandoned
+				root = other.root = nullptr;
+				throw;
+			}
+			root = p.root;
+			other.root = nullptr;
+			for(Node* x : dropped)
+			{
+				destroy(x, true);
+			}
+		}
+
+		bool parallel(thread_pool* pool, piece a, piece b)
+		{
+			return pool != nullptr && size(a.root) + size(b.root) >= SET_OP_CUTOFF;
+		}
+
+		//detaches the children of a black-rooted piece's root as pieces
+		void unlink(piece p, piece& l, piece& r)
+		{
+			int cb = p.bh - 1;
+			l = blacken(p.root->left, cb);
+			r = blacken(p.root->right, cb);
+			p.root->left = p.root->right = nullptr;
+			pull(p.root);
+		}
+
+		template <typename Merge>
+		piece union_(piece a, piece b, Merge& merge, thread_pool* pool, std::vector<Node*>& dropped)
+		{
+			if(a.root == nullptr)
+			{
+				return b;
+			}
+			if(b.root == nullptr)
+			{
+				return a;
+			}
+			bool par = parallel(pool, a, b);
+			Node* m = a.root;
+			piece al, ar, bl, br;
+			unlink(a, al, ar);
+			Node* eq = split(b.root, b.bh, m->key, bl, br);
+			if(eq != nullptr)
+			{
+				m->val = merge(m->val, eq->val);
+				dropped.push_back(eq);
+			}
+
+			piece l, r;
+			std::vector<Node*> dropped_r;
+			parallel_invoke(pool, par,
+			                [&] { l = union_(al, bl, merge, pool, dropped); },
+			                [&] { r = union_(ar, br, merge, pool, dropped_r); });
+			dropped.insert(dropped.end(), dropped_r.begin(), dropped_r.end());
+			return join(l, m, r);
+		}
+
+		template <typename Merge>
+		piece intersect_(piece a, piece b, Merge& merge, thread_pool* pool, std::vector<Node*>& dropped)
+		{
+			if(a.root == nullptr || b.root == nullptr)
+			{
+				if(a.root != nullptr) { dropped.push_back(a.root); }
+				if(b.root != nullptr) { dropped.push_back(b.root); }
+				return piece();
+			}
+			bool par = parallel(pool, a, b);
+			Node* m = a.root;
+			piece al, ar, bl, br;
+			unlink(a, al, ar);
+			Node* eq = split(b.root, b.bh, m->key, bl, br);
+
+			piece l, r;
+			std::vector<Node*> dropped_r;
+			parallel_invoke(pool, par,
+			                [&] { l = intersect_(al, bl, merge, pool, dropped); },
+			                [&] { r = intersect_(ar, br, merge, pool, dropped_r); });
+			dropped.insert(dropped.end(), dropped_r.begin(), dropped_r.end());
+
+			if(eq == nullptr)
+			{
+				dropped.push_back(m);
+				return join(l, r);
+			}
+			m->val = merge(m->val, eq->val);
+			dropped.push_back(eq);
+			return join(l, m, r);
+		}
+
+		piece difference_(piece a, piece b, thread_pool* pool, std::vector<Node*>& dropped)
+		{
+			if(a.root == nullptr || b.root == nullptr)
+			{
+				if(b.root != nullptr) { dropped.push_back(b.root); }
+				return a;
+			}
+			bool par = parallel(pool, a, b);
+			Node* m = b.root;
+			piece al, ar, bl, br;
+			unlink(b, bl, br);
+			Node* eq = split(a.root, a.bh, m->key, al, ar);
+			dropped.push_back(m);
+			if(eq != nullptr)
+			{
+				dropped.push_back(eq);
+			}
+
+			piece l, r;
+			std::vector<Node*> dropped_r;
+			parallel_invoke(pool, par,
+			                [&] { l = difference_(al, bl, pool, dropped); },
+			                [&] { r = difference_(ar, br, pool, dropped_r); });
+			dropped.insert(dropped.end(), dropped_r.begin(), dropped_r.end());
+			return join(l, r);
+		}
+
+    /***********************
+	 * Red-black tree helper functions
+	 ***********************/
+
+    // make a left-leaning link lean to the right
+    private:
+    	Node* rotate_right(Node* h) {
+	        // assert (h != null) && is_red(h->left);
+	        stats_.rotated_right();
+	        Node* x = h->left;
+	        h->left = x->right;
+	        x->right = h;
+	        x->color = x->right->color;
+	        x->right->color = RED;
+	        x->size = h->size;
+	        if constexpr (AUGMENTED)
+	        {
+	            x->agg = h->agg;
+	        }
+	        pull(h);
 	        return x;
 	    }
 
@@ -331,20 +1571,25 @@ class bst_redblack {
     private:
     	Node* rotate_left(Node* h) {
 	        // assert (h != null) && is_red(h->right);
-	        Node x = h->right;
+	        stats_.rotated_left();
+	        Node* x = h->right;
 	        h->right = x->left;
 	        x->left = h;
 	        x->color = x->left->color;
 	        x->left->color = RED;
 	        x->size = h->size;
-	        h->size = size(h->left) + size(h->right) + 1;
+	        if constexpr (AUGMENTED)
+	        {
+	            x->agg = h->agg;
+	        }
+	        pull(h);
 	        return x;
     	}
 
     // flip the colors of a Node and its two children
     private:
     	void flip_colors(Node* h) {
-        
+	        stats_.flipped();
 	        h->color = !h->color;
 	        h->left->color = !h->left->color;
 	        h->right->color = !h->right->color;
@@ -354,7 +1599,7 @@ class bst_redblack {
 		Node* move_red_left(Node* h) {
 	        // assert (h != null);
 	        // assert is_red(h) && !is_red(h.left) && !is_red(h.left.left);
-
+	        stats_.moved_red_left();
 	        flip_colors(h);
 	        if (is_red(h->right->left)) { 
 	            h->right = rotate_right(h->right);
@@ -370,6 +1615,7 @@ class bst_redblack {
     	Node* move_red_right(Node* h) {
 	        // assert (h != null);
 	        // assert is_red(h) && !is_red(h.right) && !is_red(h.right.left);
+	        stats_.moved_red_right();
 	        flip_colors(h);
 	        if (is_red(h->left->left)) { 
 	            h = rotate_right(h);
@@ -396,7 +1642,7 @@ class bst_redblack {
 	        	flip_colors(h);
 	        }
 
-	        h->size = size(h->left) + size(h->right) + 1;
+	        pull(h);
 	        return h;
 	    }
 
@@ -429,7 +1675,11 @@ class bst_redblack {
 	private:
 		Node* min(Node* x) 
 		{ 
-			return x->left  == nullptr ? x : min(x->left);  
+			while (x->left != nullptr)
+			{
+				x = x->left;
+			}
+			return x;
 		}
 
 	public:
@@ -444,11 +1694,16 @@ class bst_redblack {
 	private:
 		Node* max(Node* x) 
 		{
-			return x->right == nullptr ? x : max(x->right); 
+			while (x->right != nullptr)
+			{
+				x = x->right;
+			}
+			return x;
 		}
 
 	public:
-		Key floor(Key& key) 
+		//largest key <= key
+		Key floor(const Key& key) 
 		{
 			if (key == Key())
 			{
@@ -458,7 +1713,7 @@ class bst_redblack {
 			{ 
 				throw new std::logic_error("calls floor() with empty symbol table"); 
 			}
-			Node x = floor(root, key);
+			Node* x = floor(root, key);
 			if (x == nullptr)
 			{ 
 				throw new std::logic_error("argument to floor() is too small"); 
@@ -468,169 +1723,628 @@ class bst_redblack {
 		}
 
 	private:
-		Node floor(Node* x, Key key) 
+		Node* floor(Node* x, const Key& key) 
 		{
-			if (x == nullptr) 
+			Node* best = nullptr;
+			while (x != nullptr)
 			{
-				return nullptr; 
+				stats_.visited();
+				int cmp = compare_keys(key, x->key);
+				if (cmp == 0)
+				{ 
+					return x; 
+				}
+				if (cmp < 0)
+				{ 
+					x = x->left; 
+				} else {
+					best = x;
+					x = x->right;
+				}
 			}
+			return best;
+		}
 
-			bool key_less = less(key, x->key);
-			bool key_more = less(x->key, key);
-
-			if (key_less && key_more) // equal
+	public:
+		//smallest key >= key
+		Key ceiling(const Key& key) 
+		{
+			if (key == Key())
 			{ 
-				return x; 
-			}  
-			if (key_less)
+				throw new std::invalid_argument("argument to ceiling() is null"); 
+			}
+			if (is_empty())
 			{ 
-				return floor(x->left, key); 
+				throw new std::logic_error("calls ceiling() with empty symbol table"); 
 			}
-
-			Node* t = floor(x->right, key);
-			if (t != nullptr) 
+			Node* x = ceiling(root, key);
+			if (x == nullptr)
 			{ 
-				return t; 
+				throw new std::logic_error("argument to ceiling() is too large"); 
+			} else { 
+				return x->key; 
 			}
 		}
 
-	public:
-		Key floor2(Key& key) 
+	private:
+		Node* ceiling(Node* x, const Key& key) 
 		{
-			Key x = floor2(root, key, nullptr);
-			if (x == nullptr)
+			Node* best = nullptr;
+			while (x != nullptr)
 			{
-				throw new std::logic_error("argument to floor() is too small"); 
-			} else {
-				return x;
+				stats_.visited();
+				int cmp = compare_keys(key, x->key);
+				if (cmp == 0)
+				{ 
+					return x; 
+				}
+				if (cmp > 0)
+				{ 
+					x = x->right; 
+				} else {
+					best = x;
+					x = x->left;
+				}
 			}
+			return best;
 		}
 
-	private:
-		Key floor2(Node* x, Key key, Key best) 
+	public:
+		Key select(int rank) 
 		{
-			if (x == nullptr)
-			{ 
-				return best; 
+			if (rank < 0 || rank >= size()) 
+			{
+			  std::cerr << "argument to select() is invalid: " << rank << "\n";
+			  throw new std::invalid_argument("invalid select");
 			}
-
-			int cmp = key.compareTo(x->key);
-			if(cmp  < 0) { 
-				return floor2(x->left, key, best); 
-			} else if (cmp  > 0) { 
-				return floor2(x->right, key, x->key); 
-			} else { 
-				return x->key; 
+			return select(root, rank)->key;
+		}
+	private:
+		Node* select(Node* x, int rank) 
+		{
+			while (x != nullptr)
+			{
+				int leftSize = size(x->left);
+				if (leftSize > rank) { 
+					x = x->left; 
+				} else if (leftSize < rank) { 
+					rank -= leftSize + 1;
+					x = x->right; 
+				} else { 
+					return x; 
+				}
 			}
+			return nullptr;
 		}
 
 	public:
-		Key ceiling(Key& key) 
+		int rank(const Key& key) 
 		{
-			if (key == Key())
-			{ 
-				throw new std::invalid_argument("argument to ceiling() is null"); 
-			}
-			if (is_empty())
-			{ 
-				throw new std::logic_error("calls ceiling() with empty symbol table"); 
-			}
-			Node x = ceiling(root, key);
-			if (x == Key())
+			if (key == Key()) 
 			{ 
-				throw new std::logic_error("argument to floor() is too large"); 
-			} else { 
-				return x->key; 
+				throw new std::invalid_argument("argument to rank() is null"); 
 			}
+			return rank(key, root);
 		}
 
 	private:
-		Node* ceiling(Node* x, Key key) 
+		int rank(const Key& key, Node* x) 
 		{
-			if (x == Key())
-			{ 
-				return nullptr; 
+			int r = 0;
+			while (x != nullptr)
+			{
+				stats_.visited();
+				int cmp = compare_keys(key, x->key);
+				if (cmp < 0) { 
+					x = x->left; 
+				} else if (cmp > 0) { 
+					r += 1 + size(x->left); 
+					x = x->right; 
+				} else { 
+					return r + size(x->left); 
+				}
 			}
+			return r;
+		}
 
-			bool key_less = less(key, x->key);
-			bool key_more = less(x->key, key);
+	/***********************************************************************
+	 * Range aggregates in O(log n)
+	 *
+	 * With an Aggregate policy every node also holds the aggregate of its
+	 * subtree, kept up to date wherever size is (rotations, balance, the
+	 * insert and delete paths, split/join). A range [low, high] is the node
+	 * where the searches for low and high part ways, plus the subtrees hung
+	 * off the two search paths below it. Values must only change through
+	 * put(), not through an iterator, or the aggregates above go stale.
+	 ***********************************************************************/
+	public:
+		typename Aggregate::type aggregate()
+		{
+			static_assert(AUGMENTED, "aggregate() needs an Aggregate policy");
+			return agg(root);
+		}
 
-			if (key_less && key_more) //equal
-			{ 
-				return x; 
+		typename Aggregate::type aggregate(const Key& low, const Key& high)
+		{
+			static_assert(AUGMENTED, "aggregate() needs an Aggregate policy");
+			if(compare_keys(low, high) > 0)
+			{
+				return Aggregate::identity();
 			}
-			if (key_less) {
-			  Node* t = ceiling(x->left, key);
-			  return t != nullptr ? t : x;
+			Node* x = root;
+			while(x != nullptr)
+			{
+				if(compare_keys(high, x->key) < 0)
+				{
+					x = x->left;
+				} else if(compare_keys(low, x->key) > 0) {
+					x = x->right;
+				} else {
+					break;
+				}
+			}
+			if(x == nullptr)
+			{
+				return Aggregate::identity();
 			}
-			return ceiling(x->right, key);
+
+			//keys >= low in x->left, gathered from the right end inwards
+			typename Aggregate::type lo = Aggregate::identity();
+			for(Node* y = x->left; y != nullptr; )
+			{
+				if(compare_keys(low, y->key) <= 0)
+				{
+					lo = Aggregate::combine(Aggregate::combine(Aggregate::lift(y->key, y->val), agg(y->right)), lo);
+					y = y->left;
+				} else {
+					y = y->right;
+				}
+			}
+			//keys <= high in x->right, gathered from the left end outwards
+			typename Aggregate::type hi = Aggregate::identity();
+			for(Node* y = x->right; y != nullptr; )
+			{
+				if(compare_keys(high, y->key) >= 0)
+				{
+					hi = Aggregate::combine(hi, Aggregate::combine(agg(y->left), Aggregate::lift(y->key, y->val)));
+					y = y->right;
+				} else {
+					y = y->left;
+				}
+			}
+			return Aggregate::combine(Aggregate::combine(lo, Aggregate::lift(x->key, x->val)), hi);
 		}
 
-	public:
-		Key select(int rank) 
+		//aggregate of the keys < k in one descent; a weighted rank when the
+		//Aggregate sums weights
+		typename Aggregate::type aggregate_below(const Key& k)
 		{
-			if (rank < 0 || rank >= size()) 
+			static_assert(AUGMENTED, "aggregate_below() needs an Aggregate policy");
+			typename Aggregate::type a = Aggregate::identity();
+			for(Node* x = root; x != nullptr; )
 			{
-			  std::cerr << "argument to select() is invalid: " << rank << "\n";
-			  throw new std::invalid_argument("invalid select");
+				if(compare_keys(k, x->key) <= 0)
+				{
+					x = x->left;
+				} else {
+					a = Aggregate::combine(a, Aggregate::combine(agg(x->left), Aggregate::lift(x->key, x->val)));
+					x = x->right;
+				}
 			}
-			return select(root, rank);
+			return a;
 		}
-	private:
-		Key select(Node* x, int rank) 
+
+		//for an Aggregate that sums non-negative weights (sum_aggregate): the
+		//key at weighted rank w, i.e. the smallest key whose weight plus the
+		//weights of all smaller keys exceeds w
+		template <typename A = Aggregate>
+		Key select_aggregate(typename A::type w)
 		{
-			if (x == nullptr)
-			{ 
-				return nullptr; 
+			static_assert(AUGMENTED, "select_aggregate() needs an Aggregate policy");
+			if(w < Aggregate::identity() || !(w < agg(root)))
+			{
+				throw new std::invalid_argument("argument to select_aggregate() is invalid");
 			}
+			Node* x = root;
+			while(true)
+			{
+				typename Aggregate::type l = agg(x->left);
+				if(w < l)
+				{
+					x = x->left;
+					continue;
+				}
+				w = w - l;
+				typename Aggregate::type self = Aggregate::lift(x->key, x->val);
+				if(w < self)
+				{
+					return x->key;
+				}
+				w = w - self;
+				x = x->right;
+			}
+		}
 
-			int leftSize = size(x->left);
-			if (leftSize > rank) { 
-				return select(x->left,  rank); 
-			} else if (leftSize < rank) { 
-				return select(x->right, rank - leftSize - 1); 
-			} else { 
-				return x->key; 
+	/***********************************************************************
+	 * In-order iterators
+	 *
+	 * An iterator keeps the root-to-node path in a fixed MAX_DEPTH array, so
+	 * it never allocates; ++ and -- cost O(1) amortized, and a range scan
+	 * from lower_bound() is O(log n + k). Any put or delete invalidates
+	 * every iterator of the tree.
+	 ***********************************************************************/
+	public:
+		class iterator
+		{
+			public:
+				typedef std::bidirectional_iterator_tag iterator_category;
+				typedef std::pair<const Key&, Value&> value_type;
+				typedef std::ptrdiff_t difference_type;
+				typedef void pointer;
+				typedef value_type reference;
+
+				iterator() : root(nullptr), depth(0) { }
+
+				//only the live part of the path is copied
+				iterator(const iterator& other) : root(other.root), depth(other.depth)
+				{
+					std::copy(other.path, other.path + depth, path);
+				}
+				iterator& operator=(const iterator& other)
+				{
+					root = other.root;
+					depth = other.depth;
+					std::copy(other.path, other.path + depth, path);
+					return *this;
+				}
+
+				const Key& key() const { return path[depth - 1]->key; }
+				Value& value() const { return path[depth - 1]->val; }
+				value_type operator*() const { return value_type(key(), value()); }
+
+				iterator& operator++()
+				{
+					Node* x = path[depth - 1];
+					if(x->right != nullptr)
+					{
+						push_leftmost(x->right);
+					} else {
+						//climb until we leave a left subtree
+						do { x = path[--depth]; } while(depth > 0 && path[depth - 1]->right == x);
+					}
+					return *this;
+				}
+
+				iterator& operator--()
+				{
+					if(depth == 0)
+					{
+						push_rightmost(root);      //end() steps back to the maximum
+						return *this;
+					}
+					Node* x = path[depth - 1];
+					if(x->left != nullptr)
+					{
+						push_rightmost(x->left);
+					} else {
+						do { x = path[--depth]; } while(depth > 0 && path[depth - 1]->left == x);
+					}
+					return *this;
+				}
+
+				iterator operator++(int) { iterator before = *this;  ++*this;  return before; }
+				iterator operator--(int) { iterator before = *this;  --*this;  return before; }
+
+				bool operator==(const iterator& other) const
+				{
+					return depth == other.depth && (depth == 0 || path[depth - 1] == other.path[depth - 1]);
+				}
+				bool operator!=(const iterator& other) const { return !operator==(other); }
+
+			private:
+				friend class bst_redblack;
+				explicit iterator(Node* root_) : root(root_), depth(0) { }
+
+				void push_leftmost(Node* x)
+				{
+					for(; x != nullptr; x = x->left) { path[depth++] = x; }
+				}
+				void push_rightmost(Node* x)
+				{
+					for(; x != nullptr; x = x->right) { path[depth++] = x; }
+				}
+
+				Node* root;
+				Node* path[MAX_DEPTH];
+				int depth;
+		};
+
+		iterator begin()
+		{
+			iterator it(root);
+			it.push_leftmost(root);
+			return it;
+		}
+
+		iterator end()
+		{
+			return iterator(root);
+		}
+
+		//first key >= k
+		iterator lower_bound(const Key& k)
+		{
+			return bound(k, false);
+		}
+
+		template <typename K, typename C = Compare, typename = typename C::is_transparent>
+		iterator lower_bound(const K& k)
+		{
+			return bound(k, false);
+		}
+
+		//first key > k
+		iterator upper_bound(const Key& k)
+		{
+			return bound(k, true);
+		}
+
+		template <typename K, typename C = Compare, typename = typename C::is_transparent>
+		iterator upper_bound(const K& k)
+		{
+			return bound(k, true);
+		}
+
+		//read-only copy in a contiguous, branch-free searchable layout; later
+		//changes to this tree do not affect it. frozen_st orders keys by <
+		frozen_st<Key, Value> freeze()
+		{
+			static_assert(std::is_same<Compare, three_way<Key>>::value,
+			              "freeze() needs the default < ordering");
+			return frozen_st<Key, Value>(begin(), end());
+		}
+
+	/***********************************************************************
+	 * Binary snapshots (see st_snapshot.h)
+	 *
+	 * save() writes the keys and values in order as a versioned, checksummed
+	 * image; std::string keys and values go into a string arena. load() maps
+	 * the image and rebuilds the tree with build_from_sorted(), which is
+	 * linear: no tokenizing and no search per key. To serve reads straight
+	 * from the file without building anything, open it as a mapped_st.
+	 * save() replaces path atomically, so it is safe while a mapped_st is
+	 * reading the old snapshot.
+	 ***********************************************************************/
+	public:
+		void save(const std::string& path)
+		{
+			save_snapshot<Key, Value>(path, begin(), end(), size());
+		}
+
+		static bst_redblack load(const std::string& path, const Compare& comp = Compare())
+		{
+			mapped_st<Key, Value, Compare> m(path, true, comp);
+			return build_from_sorted(m.begin(), m.end(), comp);
+		}
+
+	private:
+		//walks the search path for k and cuts it back to the last node where
+		//the search turned left, which is the answer
+		template <typename K>
+		iterator bound(const K& k, bool strict)
+		{
+			iterator it(root);
+			int keep = 0;
+			for(Node* x = root; x != nullptr; )
+			{
+				it.path[it.depth++] = x;
+				stats_.visited();
+				int cmp = compare_keys(k, x->key);
+				if(strict ? cmp < 0 : cmp <= 0)
+				{
+					keep = it.depth;
+					x = x->left;
+				} else {
+					x = x->right;
+				}
 			}
+			it.depth = keep;
+			return it;
 		}
 
+	/***********************************************************************
+	 * Finger insertion
+	 *
+	 * put_hint() starts the search for k from an iterator's path instead of
+	 * the root. It climbs only as far as the nearest ancestor that bounds k
+	 * on the far side, then searches down, so a key at distance d from the
+	 * hint costs O(log d) comparisons. Insertion rebalancing is amortized
+	 * O(1); the size fields above it are still bumped up to the root, which
+	 * is a cache-hot walk with no comparisons. The returned iterator points
+	 * at k and is the natural hint for the next key.
+	 *
+	 * With set_auto_finger(true), put() keeps such an iterator at the last
+	 * key it put and searches from it while consecutive keys land close
+	 * together (their paths share the lower half), so ascending, descending
+	 * and nearly sorted runs get the same cost without the caller passing
+	 * hints, and scattered keys still start at the root. A hint left stale
+	 * by other changes is detected (its path is checked against the current
+	 * links) and the search then starts at the root.
+	 ***********************************************************************/
 	public:
-		int rank(Key& key) 
+		iterator put_hint(const iterator& hint, const Key& k, const Value& v)
 		{
-			if (key == Key()) 
-			{ 
-				throw new std::invalid_argument("argument to rank() is null"); 
+			if(k == Key())
+			{
+				throw new std::invalid_argument("first arguement to put_hint() is null");
+			}
+			if(v == Value())
+			{
+				delete_(k);
+				return end();
+			}
+			iterator it = hint;
+			put_from(it, k, v);
+			return it;
+		}
+
+		void set_auto_finger(bool on)
+		{
+			if(!on)
+			{
+				finger_.reset();
+			} else if(finger_ == nullptr) {
+				finger_.reset(new finger());
 			}
-			return rank(key, root);
+		}
+
+		bool auto_finger() const
+		{
+			return finger_ != nullptr;
 		}
 
 	private:
-		int rank(Key key, Node* x) 
+		struct finger
 		{
-			if (x == nullptr) 
-			{ 
-				return 0; 
+			finger() : near(false) { }
+			iterator at;
+			bool near;     //the last key landed close to the one before it
+		};
+
+		std::unique_ptr<finger> finger_;
+
+		template <typename K, typename V>
+		void put_with_finger(K&& k, V&& v)
+		{
+			finger& f = *finger_;
+			put_from(f.at, std::forward<K>(k), std::forward<V>(v), &f.near);
+		}
+
+		//puts k searching from the path in it (the root if it is empty or
+		//stale); it comes back holding the path to k. With near given, the
+		//path is only searched from when *near is set, and *near is then set
+		//to whether k's path shares the lower half of the old one, so runs
+		//of nearby keys use the finger and scattered keys start at the root
+		template <typename K, typename V>
+		void put_from(iterator& it, K&& k, V&& v, bool* near = nullptr)
+		{
+			//links to the nodes on the path, checked against the tree as they
+			//are collected so that a stale path is caught
+			Node** path[MAX_DEPTH];
+			path[0] = &root;
+			int valid = (it.depth > 0 && it.path[0] == root) ? it.depth : 0;
+			for(int t = 1; t < valid; ++t)
+			{
+				Node* p = it.path[t - 1];
+				if(it.path[t] == p->left)
+				{
+					path[t] = &p->left;
+				} else if(it.path[t] == p->right) {
+					path[t] = &p->right;
+				} else {
+					valid = 0;
+				}
 			}
 
-			if (less(key, x->key)) { 
-				return rank(key, x->left); 
-			} else if (less(x->key, key)) { 
-				return 1 + size(x->left) + rank(key, x->right); 
-			} else { 
-				return size(x->left); 
+			int s = 0;          //depth of the node the downward search starts at
+			if(valid > 0 && (near == nullptr || *near))
+			{
+				int cmp = compare_keys(k, it.path[valid - 1]->key);
+				s = valid - 1;
+				if(cmp != 0)
+				{
+					//for k above the hint only the ancestors where the path
+					//turns left bound the subtrees on the path (from above),
+					//and symmetrically for k below it. Climb past the bounds
+					//that k lies beyond; the first one that holds stops us
+					bool right = cmp > 0;
+					for(int j = s - 1; j >= 0; --j)
+					{
+						if((path[j + 1] == &it.path[j]->left) != right)
+						{
+							continue;
+						}
+						int c = compare_keys(k, it.path[j]->key);
+						if(c != 0 && (c < 0) == right)
+						{
+							break;
+						}
+						s = j;
+						if(c == 0)
+						{
+							break;
+						}
+					}
+				}
+			}
+
+			int d = s;
+			int shared = 0;     //length of the prefix k's path shares with the old one
+			Node** link = path[s];
+			while(*link != nullptr)
+			{
+				Node* h = *link;
+				if(d < valid && h == it.path[d])
+				{
+					shared = d + 1;
+				}
+				stats_.visited();
+				int cmp = compare_keys(k, h->key);
+				if(cmp == 0)
+				{
+					h->val = std::forward<V>(v);
+					if constexpr (AUGMENTED)
+					{
+						pull_path(path, d + 1);
+					}
+					for(int t = 0; t <= d; ++t)
+					{
+						it.path[t] = *path[t];
+					}
+					it.depth = d + 1;
+					if(near != nullptr)
+					{
+						*near = 2 * shared > valid;
+					}
+					return;
+				}
+				assert(d + 1 < MAX_DEPTH);
+				path[d++] = link;
+				link = (cmp < 0 ? &h->left : &h->right);
+				path[d] = link;
 			}
+			if(near != nullptr)
+			{
+				*near = 2 * shared > valid;
+			}
+			*link = new_node(std::forward<K>(k), std::forward<V>(v));
+			Node* x = *link;
+			int stop = fix_insert(path, d);
+
+			//nodes above stop are unchanged; find x again below it
+			for(int t = 0; t <= stop; ++t)
+			{
+				it.path[t] = *path[t];
+			}
+			it.depth = stop + 1;
+			for(Node* h = it.path[stop]; h != x; )
+			{
+				h = (compare_keys(x->key, h->key) < 0 ? h->left : h->right);
+				it.path[it.depth++] = h;
+			}
+			it.root = root;
 		}
 
 	public:
-		void keys(Node* x, queue_<Key>& q, Key low, Key high) 
+		void keys(Node* x, queue_<Key>& q, const Key& low, const Key& high) 
 		{
 			if (x == nullptr) 
 			{ 
 				return; 
 			}
 
-			bool low_le  = less(low, x->key)  || low  == x->key;
-			bool high_ge = less(x->key, high) || high == x->key;
+			bool low_le  = compare_keys(low, x->key) <= 0;
+			bool high_ge = compare_keys(high, x->key) >= 0;
 
 			if (low_le) // le == less than or equal to (a la Python)
 			{ 
@@ -656,7 +2370,7 @@ class bst_redblack {
 			return keys(min_key, max_key);
 		}
 
-		array_queue<Key> keys(Key& low, Key& high) 
+		array_queue<Key> keys(const Key& low, const Key& high) 
 		{
 			if (low == Key())  
 			{ 
@@ -672,7 +2386,7 @@ class bst_redblack {
 			return q;
 		}
 
-		int size(Key& low, Key& high) 
+		int size(const Key& low, const Key& high) 
 		{
 			if (low == Key())
 			{ 
@@ -683,7 +2397,7 @@ class bst_redblack {
 				throw new std::invalid_argument("second argument to size() is null"); 
 			}
 
-			if (low.compareTo(high) > 0) 
+			if (compare_keys(low, high) > 0) 
 			{ 
 				return 0; 
 			}
@@ -749,6 +2463,21 @@ class bst_redblack {
 				std::cerr << "Ranks not consistent\n";           
 				return false;  
 			}
+			if (!is_23())
+			{ 
+				std::cerr << "Not a 2-3 tree\n";                 
+				return false;  
+			}
+			if (!is_balanced())
+			{ 
+				std::cerr << "Not balanced\n";                   
+				return false;  
+			}
+			if (!is_aggregate_consistent(root))
+			{ 
+				std::cerr << "Subtree aggregates not consistent\n";
+				return false;  
+			}
 			return true;
 		}
 
@@ -767,16 +2496,16 @@ class bst_redblack {
 			}
 			Key default_key = Key();
 
-			if (min != default_key && less(x->key, min) <= 0) 
+			if (min != default_key && compare_keys(x->key, min) <= 0) 
 			{ 
 				return false; 
 			}
-			if (max != default_key && less(max, x->key))   
+			if (max != default_key && compare_keys(x->key, max) >= 0)   
 			{ 
 				return false; 
 			}
 			bool left_bst = is_bst(x->left, min, x->key);
-			bool right_bst = is_bst(x->left, min, x->key);
+			bool right_bst = is_bst(x->right, x->key, max);
 			return (left_bst && right_bst);
 		}
 
@@ -798,6 +2527,74 @@ class bst_redblack {
 			return ( is_size_consistent(x->left) && is_size_consistent(x->right) );
 		}
 
+		//a black root, no red right links and no two reds in a row
+		bool is_23()
+		{
+			return !is_red(root) && is_23(root);
+		}
+
+		bool is_23(Node* x)
+		{
+			if (x == nullptr)
+			{
+				return true;
+			}
+			if (is_red(x->right))
+			{
+				return false;
+			}
+			if (is_red(x) && is_red(x->left))
+			{
+				return false;
+			}
+			return ( is_23(x->left) && is_23(x->right) );
+		}
+
+		//the same number of black links on every path from the root to a null link
+		bool is_balanced()
+		{
+			int black = 0;
+			for (Node* x = root; x != nullptr; x = x->left)
+			{
+				if (!is_red(x))
+				{
+					++black;
+				}
+			}
+			return is_balanced(root, black);
+		}
+
+		bool is_balanced(Node* x, int black)
+		{
+			if (x == nullptr)
+			{
+				return black == 0;
+			}
+			if (!is_red(x))
+			{
+				--black;
+			}
+			return ( is_balanced(x->left, black) && is_balanced(x->right, black) );
+		}
+
+		bool is_aggregate_consistent(Node* x)
+		{
+			if constexpr (AUGMENTED)
+			{
+				if (x == nullptr)
+				{
+					return true;
+				}
+				if (!(x->agg == Aggregate::combine(Aggregate::combine(agg(x->left), Aggregate::lift(x->key, x->val)),
+				                                   agg(x->right))))
+				{
+					return false;
+				}
+				return ( is_aggregate_consistent(x->left) && is_aggregate_consistent(x->right) );
+			}
+			return true;
+		}
+
 		bool is_rank_consistent() 
 		{
 			for (int i = 0; i < size(); i++) 
@@ -811,7 +2608,7 @@ class bst_redblack {
 			for (Key& key : keys()) 
 			{
 				Key key_at_rank = select(rank(key));
-				if (less(key, key_at_rank) || less(key_at_rank, key)) // if !equal
+				if (compare_keys(key, key_at_rank) != 0)
 				{  
 					return false;
 				}
@@ -819,6 +2616,7 @@ class bst_redblack {
 			return true;
 		}
 
+	public:
 		array_queue<Key> level_order() 
 		{
 			array_queue<Key> keys;
@@ -846,10 +2644,361 @@ class bst_redblack {
 		{
 			test_bst("tinyST.txt");
 			test_bst("gettysburg_ST.txt");
+			test_random_ops(200, 20000, 20200311);
+			test_split_join(300, 20200311);
+			test_set_ops(20200311);
+			test_delete_range(300, 20200311);
+			test_finger(20000, 20200311);
+			test_upsert(20000, 20200311);
+		}
+
+		//ops random put/delete_/delete_min/delete_max calls on keys 1 .. n,
+		//checked against std::map and check() after every one
+		static void test_random_ops(int n, int ops, unsigned seed)
+		{
+			std::mt19937 gen(seed);
+			bst_redblack<int, int> st;
+			std::map<int, int> m;
+			for (int i = 0; i < ops; ++i)
+			{
+				int k = 1 + (int)(gen() % n);
+				int op = (int)(gen() % 20);
+				if (op < 10)
+				{
+					int v = 1 + (int)(gen() % 1000);
+					st.put(k, v);
+					m[k] = v;
+				} else if (op < 18) {
+					if (st.delete_(k) != (m.erase(k) == 1))
+					{
+						throw new std::logic_error("test_random_ops: delete_() result is wrong");
+					}
+				} else if (!m.empty()) {
+					if (op == 18)
+					{
+						st.delete_min();
+						m.erase(m.begin());
+					} else {
+						st.delete_max();
+						m.erase(std::prev(m.end()));
+					}
+				}
+				expect_same(st, m, "test_random_ops");
+			}
+			std::cout << "test_random_ops: " << ops << " operations on " << n << " keys, ok\n";
+		}
+
+		//split at random keys, both join()s of the pieces back together, and
+		//join() of trees built apart, each against std::map
+		static void test_split_join(int trials, unsigned seed)
+		{
+			std::mt19937 gen(seed);
+			for (int t = 0; t < trials; ++t)
+			{
+				int range = 1 + (int)(gen() % 3000);
+				bst_redblack<int, int> st;
+				std::map<int, int> m;
+				random_fill(st, m, (int)(gen() % (range + 1)), range, gen);
+				int k = 1 + (int)(gen() % (range + 1));
+
+				std::pair<bst_redblack<int, int>, bst_redblack<int, int>> halves = st.split(k);
+				std::map<int, int> lt(m.begin(), m.lower_bound(k)), ge(m.lower_bound(k), m.end());
+				expect_same(st, std::map<int, int>(), "test_split_join: split source");
+				expect_same(halves.first, lt, "test_split_join: keys < k");
+				expect_same(halves.second, ge, "test_split_join: keys >= k");
+
+				if (t % 2 == 0)
+				{
+					bst_redblack<int, int> joined = bst_redblack<int, int>::join(std::move(halves.first), std::move(halves.second));
+					expect_same(joined, m, "test_split_join: join");
+				} else {
+					//k goes back in as the middle key of the three-way join
+					int v = 1 + (int)(gen() % 1000);
+					halves.second.delete_(k);
+					m[k] = v;
+					bst_redblack<int, int> joined = bst_redblack<int, int>::join(std::move(halves.first), k, v, std::move(halves.second));
+					expect_same(joined, m, "test_split_join: join with a middle key");
+				}
+			}
+
+			for (int t = 0; t < trials; ++t)
+			{
+				int cut = 1 + (int)(gen() % 2000);
+				bst_redblack<int, int> a, b;
+				std::map<int, int> ma, mb;
+				random_fill(a, ma, (int)(gen() % cut), cut - 1, gen);
+				for (int i = (int)(gen() % 2000); i > 0; --i)
+				{
+					int k = cut + 1 + (int)(gen() % 2000), v = 1 + (int)(gen() % 1000);
+					b.put(k, v);
+					mb[k] = v;
+				}
+				ma.insert(mb.begin(), mb.end());
+				bst_redblack<int, int> joined = bst_redblack<int, int>::join(std::move(a), std::move(b));
+				expect_same(joined, ma, "test_split_join: join of separate trees");
+			}
+			std::cout << "test_split_join: " << 2 * trials << " trials, ok\n";
+		}
+
+		//union_with, intersect_with and difference on random trees of very
+		//different sizes, without a pool and with one large enough to run
+		//subproblems in parallel, against std::map
+		static void test_set_ops(unsigned seed)
+		{
+			std::mt19937 gen(seed);
+			thread_pool pool(4);
+			const int sizes[][2] = { { 0, 0 }, { 0, 50 }, { 50, 0 }, { 1, 1000 }, { 1000, 1 }, { 300, 300 },
+			                         { 20000, 20000 }, { 50000, 3000 }, { 3000, 50000 } };
+			auto merge = [](int mine, int theirs) { return mine + 1000 * theirs; };
+			int cases = 0;
+			for (const int* nm : sizes)
+			{
+				for (int op = 0; op < 3; ++op)
+				{
+					for (int with_pool = 0; with_pool < 2; ++with_pool)
+					{
+						int range = 2 * (nm[0] + nm[1]) + 1;
+						bst_redblack<int, int> a, b;
+						std::map<int, int> ma, mb;
+						random_fill(a, ma, nm[0], range, gen);
+						random_fill(b, mb, nm[1], range, gen);
+
+						std::map<int, int> want;
+						thread_pool* p = with_pool ? &pool : nullptr;
+						if (op == 0)
+						{
+							want = mb;
+							for (auto& kv : ma)
+							{
+								auto it = mb.find(kv.first);
+								want[kv.first] = it == mb.end() ? kv.second : merge(kv.second, it->second);
+							}
+							a.union_with(std::move(b), merge, p);
+						} else if (op == 1) {
+							for (auto& kv : ma)
+							{
+								auto it = mb.find(kv.first);
+								if (it != mb.end()) { want[kv.first] = merge(kv.second, it->second); }
+							}
+							a.intersect_with(std::move(b), merge, p);
+						} else {
+							for (auto& kv : ma)
+							{
+								if (mb.count(kv.first) == 0) { want.insert(kv); }
+							}
+							a.difference(std::move(b), p);
+						}
+						expect_same(a, want, "test_set_ops");
+						expect_same(b, std::map<int, int>(), "test_set_ops: consumed tree");
+						++cases;
+					}
+				}
+			}
+
+			//the halves of a split share an allocator; union them back together
+			bst_redblack<int, int> st;
+			std::map<int, int> m;
+			random_fill(st, m, 30000, 60000, gen);
+			std::pair<bst_redblack<int, int>, bst_redblack<int, int>> halves = st.split(30000);
+			halves.second.union_with(std::move(halves.first), merge, &pool);
+			expect_same(halves.second, m, "test_set_ops: union of split halves");
+			std::cout << "test_set_ops: " << cases + 1 << " cases, ok\n";
+		}
+
+		//delete_range over random, empty, reversed and out-of-range bounds,
+		//checking the count, the entries handed to fn and what is left
+		static void test_delete_range(int trials, unsigned seed)
+		{
+			std::mt19937 gen(seed);
+			for (int t = 0; t < trials; ++t)
+			{
+				int range = 1 + (int)(gen() % 3000);
+				bst_redblack<int, int> st;
+				std::map<int, int> m;
+				st.set_auto_finger(t % 2 == 1);
+				random_fill(st, m, (int)(gen() % (range + 1)), range, gen);
+				for (int r = 0; r < 3; ++r)
+				{
+					int low = 1 + (int)(gen() % (range + 10)), high = 1 + (int)(gen() % (range + 10));
+					if (r == 0 && low > high)
+					{
+						std::swap(low, high);
+					}
+					std::vector<std::pair<int, int>> got;
+					int n = st.delete_range(low, high, [&](const int& k, const int& v) { got.emplace_back(k, v); });
+
+					std::vector<std::pair<int, int>> want;
+					if (low <= high)
+					{
+						auto first = m.lower_bound(low), last = m.upper_bound(high);
+						want.assign(first, last);
+						m.erase(first, last);
+					}
+					if (n != (int)want.size() || got != want)
+					{
+						throw new std::logic_error("test_delete_range: wrong entries removed");
+					}
+					expect_same(st, m, "test_delete_range");
+
+					//the tree must stay usable, finger included
+					for (int i = 0; i < 20; ++i)
+					{
+						int k = 1 + (int)(gen() % range), v = 1 + (int)(gen() % 1000);
+						st.put(k, v);
+						m[k] = v;
+					}
+					expect_same(st, m, "test_delete_range: puts after");
+				}
+			}
+			std::cout << "test_delete_range: " << 3 * trials << " ranges, ok\n";
+		}
+
+		//put_hint() from fresh, begin/end, lower_bound and stale hints, and
+		//put() with the auto finger through ascending, descending and random
+		//runs mixed with deletes that leave the finger stale
+		static void test_finger(int ops, unsigned seed)
+		{
+			std::mt19937 gen(seed);
+			bst_redblack<int, int> hinted, fingered;
+			std::map<int, int> m;
+			fingered.set_auto_finger(true);
+			bst_redblack<int, int>::iterator hint = hinted.end();
+			int next = 1, step = 1, mode = 0;
+			for (int i = 0; i < ops; ++i)
+			{
+				if (i % 500 == 0)
+				{
+					mode = (int)(gen() % 3);
+					next = 1 + (int)(gen() % 2000);
+					step = mode == 1 ? -1 - (int)(gen() % 3) : 1 + (int)(gen() % 3);
+				}
+				int k = mode == 2 ? 1 + (int)(gen() % 2000) : next;
+				next = next + step < 1 ? 2000 : next + step > 2000 ? 1 : next + step;
+				int v = 1 + (int)(gen() % 1000), op = (int)(gen() % 20);
+				if (op < 2)
+				{
+					//deletes move nodes around under both the hint and the finger
+					hinted.delete_(k);
+					fingered.delete_(k);
+					m.erase(k);
+				} else {
+					if (op == 2)
+					{
+						hint = hinted.begin();
+					} else if (op == 3) {
+						hint = hinted.end();
+					} else if (op == 4) {
+						hint = hinted.lower_bound(1 + (int)(gen() % 2000));
+					}
+					hint = hinted.put_hint(hint, k, v);
+					if (hint == hinted.end() || hint.key() != k || hint.value() != v)
+					{
+						throw new std::logic_error("test_finger: put_hint() returned the wrong iterator");
+					}
+					fingered.put(k, v);
+					m[k] = v;
+				}
+				if (i % 25 == 0 || m.size() < 100)
+				{
+					expect_same(hinted, m, "test_finger: put_hint");
+					expect_same(fingered, m, "test_finger: auto finger");
+				}
+			}
+			expect_same(hinted, m, "test_finger: put_hint");
+			expect_same(fingered, m, "test_finger: auto finger");
+			std::cout << "test_finger: " << ops << " operations, ok\n";
+		}
+
+		//upserts that add to, zero or create counts on a tree summing its
+		//values, so that emptied keys go through remove_at() and every
+		//path's aggregates are checked, with the auto finger off and on
+		static void test_upsert(int ops, unsigned seed)
+		{
+			typedef bst_redblack<int, long, node_arena, three_way<int>, sum_aggregate<long>> counts;
+			std::mt19937 gen(seed);
+			for (int pass = 0; pass < 2; ++pass)
+			{
+				counts st;
+				std::map<int, long> m;
+				st.set_auto_finger(pass == 1);
+				for (int i = 0; i < ops; ++i)
+				{
+					int k = 1 + (int)(gen() % 300);
+					int op = (int)(gen() % 4);
+					long d = 1 + (long)(gen() % 3);
+					bool was = m.count(k) == 1, inserted;
+					long& c = m[k];
+					if (op == 0)
+					{
+						inserted = st.upsert(k, [](long& x) { x = 0; });
+						c = 0;
+					} else if (op == 1) {
+						inserted = st.upsert(k, [d](long& x) { x = x > d ? x - d : 0; });
+						c = c > d ? c - d : 0;
+					} else {
+						inserted = st.upsert(k, [d](long& x) { x += d; });
+						c += d;
+					}
+					bool kept = c != 0;
+					if (!kept)
+					{
+						m.erase(k);
+					}
+					if (inserted != (!was && kept))
+					{
+						throw new std::logic_error("test_upsert: upsert() result is wrong");
+					}
+					long sum = 0;
+					for (auto& kv : m)
+					{
+						sum += kv.second;
+					}
+					if (st.aggregate() != sum)
+					{
+						throw new std::logic_error("test_upsert: aggregate() is wrong");
+					}
+					expect_same(st, m, "test_upsert");
+				}
+			}
+			std::cout << "test_upsert: " << 2 * ops << " operations, ok\n";
+		}
+
+	private:
+		//puts n random keys from 1 .. range into st and m
+		static void random_fill(bst_redblack<int, int>& st, std::map<int, int>& m, int n, int range, std::mt19937& gen)
+		{
+			for (int i = 0; i < n; ++i)
+			{
+				int k = 1 + (int)(gen() % range), v = 1 + (int)(gen() % 1000);
+				st.put(k, v);
+				m[k] = v;
+			}
 		}
+
+		//trees of other instantiations are checked from run_tests()
+		template <typename, typename, template <typename> class, typename, typename, typename>
+		friend class bst_redblack;
+
+		//throws unless st holds exactly m's entries and passes check()
+		template <typename Tree, typename Map>
+		static void expect_same(Tree& st, const Map& m, const std::string& what)
+		{
+			bool same = st.check() && st.size() == (int)m.size();
+			auto it = m.begin();
+			for (auto x = st.begin(); same && x != st.end(); ++x, ++it)
+			{
+				same = x.key() == it->first && x.value() == it->second;
+			}
+			if (!same)
+			{
+				throw new std::logic_error(what + ": tree disagrees with std::map");
+			}
+		}
+
+	public:
 		static void test_bst(const std::string& filename) {
 			char buf[BUFSIZ];
-			bst<std::string, int> st;
+			bst_redblack<std::string, int> st;
 
 			std::ifstream ifs(filename);
 			if (!ifs.is_open()) 
@@ -876,15 +3025,543 @@ class bst_redblack {
 			std::cout << "\n";
 
 			std::cout << "\nin level order (root to leaves)...\n";
-			array_queue<Key> keys = st.level_order();
+			array_queue<std::string> keys = st.level_order();
 			for (std::string& key : keys) {
 			  std::cout << std::setw(12) << key << "  " << std::setw(2) << st.get(key) << "\n";
 			}
 
 			std::cout << "\nin alphabetical order...\n";
-			keys = st.keys();
-			for (std::string& key : keys) {
-			  std::cout << std::setw(14) << key << "  " << std::setw(2) << st.get(key) << "\n";
+			for (auto it = st.begin(); it != st.end(); ++it) {
+			  std::cout << std::setw(14) << it.key() << "  " << std::setw(2) << it.value() << "\n";
+			}
+		}
+
+	/***********************************************************************
+	 * Instrumentation
+	 *
+	 * With Stats = counting_stats every comparison, search visit, rotation,
+	 * color flip, move_red_left/right and node allocation is counted, and
+	 * get()/put() lookups are binned by the depth they ended at. stats()
+	 * copies the counters out; stats().to_json(os) writes them as one JSON
+	 * object for graphing over time. With no_stats the hooks are empty and
+	 * stats() is always {}.
+	 ***********************************************************************/
+	public:
+		Stats stats() const
+		{
+			return stats_;
+		}
+
+		void reset_stats()
+		{
+			stats_.reset();
+		}
+
+	/***********************
+	 * Benchmarks
+	 ***********************/
+	public:
+		//union of two n-key tables (half the keys shared), one put per key
+		//versus union_with on 1 .. hardware_concurrency() threads
+		static void bench_set_ops(int n)
+		{
+			std::mt19937 gen(20200311);
+			std::vector<std::pair<int, int>> a, b;
+			for(int i = 1; i <= 3 * n / 2; ++i)
+			{
+				if(i % 3 != 0) { a.push_back(std::make_pair(i, 1)); }
+				if(i % 3 != 1) { b.push_back(std::make_pair(i, 1)); }
+			}
+			std::cout << "bench_set_ops: union of " << a.size() << " and " << b.size() << " keys\n";
+
+			{
+				bst_redblack x = build_from_sorted(a.begin(), a.end());
+				std::vector<std::pair<int, int>> shuffled(b);
+				std::shuffle(shuffled.begin(), shuffled.end(), gen);
+				stopwatch sw;
+				for(std::pair<int, int>& kv : shuffled)
+				{
+					x.put(kv.first, x.get(kv.first) + kv.second);
+				}
+				std::cout << "  get+put per key:  " << sw.seconds() * 1000 << " ms\n";
+			}
+
+			int cores = std::max(1, (int)std::thread::hardware_concurrency());
+			for(int t = 1; t <= cores; t *= 2)
+			{
+				thread_pool pool(t - 1);
+				bst_redblack x = build_from_sorted(a.begin(), a.end());
+				bst_redblack y = build_from_sorted(b.begin(), b.end());
+				stopwatch sw;
+				x.union_with(std::move(y), [](const Value& v, const Value& w) { return v + w; },
+				             t == 1 ? nullptr : &pool);
+				std::cout << "  union_with, " << std::setw(2) << t << " threads: " << sw.seconds() * 1000 << " ms\n";
+			}
+		}
+
+		//random get() on an n-key table versus its freeze()d copy
+		static void bench_freeze(int n)
+		{
+			std::vector<std::pair<int, int>> kvs(n);
+			for(int i = 0; i < n; ++i)
+			{
+				kvs[i] = std::make_pair(2 * i + 1, i + 1);
+			}
+			bst_redblack st = build_from_sorted(kvs.begin(), kvs.end());
+			stopwatch sw;
+			frozen_st<int, int> fz = st.freeze();
+			std::cout << "bench_freeze: " << n << " keys, freeze() took " << sw.seconds() * 1000 << " ms, "
+			          << (size_t)n * bytes_per_node() / 1024 << " KiB as nodes, " << fz.bytes() / 1024 << " KiB frozen\n";
+
+			std::mt19937 gen(20200311);
+			std::uniform_int_distribution<int> pick(1, 2 * n);
+			std::vector<int> qs(2000000);
+			for(int& k : qs) { k = pick(gen); }
+
+			long sum_tree = 0, sum_frozen = 0;
+			sw.reset();
+			for(int k : qs) { sum_tree += st.get(k); }
+			double t_tree = sw.seconds();
+			sw.reset();
+			for(int k : qs) { sum_frozen += fz.get(k); }
+			double t_frozen = sw.seconds();
+			if(sum_tree != sum_frozen)
+			{
+				throw new std::logic_error("bench_freeze: frozen_st disagrees with get");
+			}
+			std::cout << "  bst_redblack get: " << std::setw(7) << t_tree * 1e9 / qs.size() << " ns\n";
+			std::cout << "  frozen_st get:    " << std::setw(7) << t_frozen * 1e9 / qs.size() << " ns\n";
+		}
+
+		//batches of `batch` random lookups on an n-key table, a get() per key
+		//versus get_many(); pick n so the tree is well past the L3 cache
+		//(n * bytes_per_node() bytes)
+		static void bench_get_many(int n, int batch)
+		{
+			std::vector<std::pair<int, int>> kvs(n);
+			for(int i = 0; i < n; ++i)
+			{
+				kvs[i] = std::make_pair(2 * i + 1, i + 1);
+			}
+			bst_redblack st = build_from_sorted(kvs.begin(), kvs.end());
+			std::cout << "bench_get_many: " << n << " keys (" << (size_t)n * bytes_per_node() / (1 << 20)
+			          << " MiB of nodes), batches of " << batch << "\n";
+
+			std::mt19937 gen(20200311);
+			std::uniform_int_distribution<int> pick(1, 2 * n);    //about half are misses
+			int batches = std::max(1, 2000000 / batch);
+			std::vector<std::vector<int>> queries(batches, std::vector<int>(batch));
+			for(std::vector<int>& q : queries)
+			{
+				for(int& k : q) { k = pick(gen); }
+			}
+
+			long sum_get = 0, sum_many = 0;
+			stopwatch sw;
+			for(std::vector<int>& q : queries)
+			{
+				for(int k : q) { sum_get += st.get(k); }
+			}
+			double t_get = sw.seconds();
+
+			std::vector<int> out;
+			sw.reset();
+			for(std::vector<int>& q : queries)
+			{
+				st.get_many(q, out);
+				for(int v : out) { sum_many += v; }
+			}
+			double t_many = sw.seconds();
+
+			if(sum_get != sum_many)
+			{
+				throw new std::logic_error("bench_get_many: get_many disagrees with get");
+			}
+			double lookups = (double)batches * batch;
+			std::cout << "  get loop:  " << std::setw(7) << t_get * 1e9 / lookups << " ns/lookup\n";
+			std::cout << "  get_many:  " << std::setw(7) << t_many * 1e9 / lookups << " ns/lookup\n";
+		}
+
+		//sums of the values over random ranges of n / 2 keys: a keys(lo, hi)
+		//scan with a get() per key versus aggregate(lo, hi)
+		static void bench_aggregate(int n)
+		{
+			typedef bst_redblack<int, int, Alloc, three_way<int>, sum_aggregate<long>> summed;
+			std::vector<std::pair<int, int>> kvs(n);
+			for(int i = 0; i < n; ++i)
+			{
+				kvs[i] = std::make_pair(i + 1, i % 1000 + 1);
+			}
+			summed st = summed::build_from_sorted(kvs.begin(), kvs.end());
+			std::cout << "bench_aggregate: " << n << " keys, ranges of " << n / 2 << " keys\n";
+
+			std::mt19937 gen(20200311);
+			std::uniform_int_distribution<int> pick(1, n - n / 2 + 1);
+			std::vector<int> los(20);
+			for(int& lo : los) { lo = pick(gen); }
+
+			long sum_scan = 0, sum_agg = 0;
+			stopwatch sw;
+			for(int lo : los)
+			{
+				int hi = lo + n / 2 - 1;
+				array_queue<int> ks = st.keys(lo, hi);
+				for(int k : ks) { sum_scan += st.get(k); }
+			}
+			double t_scan = sw.seconds() / los.size();
+
+			const int rounds = 5000;
+			sw.reset();
+			for(int i = 0; i < rounds; ++i)
+			{
+				for(int lo : los) { sum_agg += st.aggregate(lo, lo + n / 2 - 1); }
+			}
+			double t_agg = sw.seconds() / ((double)rounds * los.size());
+
+			if(sum_scan * rounds != sum_agg)
+			{
+				throw new std::logic_error("bench_aggregate: aggregate disagrees with the scan");
+			}
+			std::cout << "  keys + get scan: " << std::setw(10) << t_scan * 1e6 << " us/range\n";
+			std::cout << "  aggregate:       " << std::setw(10) << t_agg * 1e6 << " us/range\n";
+		}
+
+		//ingesting n sorted keys, then n nearly sorted ones (every tenth key
+		//swapped with one up to 16 places away), as ints and as timestamp-like
+		//strings that share a long prefix: put() from the root, put_hint()
+		//chained on the returned iterator, and put() with set_auto_finger(true)
+		static void bench_finger(int n)
+		{
+			std::vector<int> sorted(n), nearly(n);
+			for(int i = 0; i < n; ++i)
+			{
+				sorted[i] = nearly[i] = i + 1;
+			}
+			std::mt19937 gen(20200311);
+			for(int i = 0; i + 16 < n; i += 10)
+			{
+				std::swap(nearly[i], nearly[i + 1 + gen() % 16]);
 			}
+			std::vector<std::string> sorted_s(n), nearly_s(n);
+			for(int i = 0; i < n; ++i)
+			{
+				char buf[64];
+				snprintf(buf, sizeof buf, "metrics/eu-west-1/host-0042/2020-03-11T%09d", sorted[i]);
+				sorted_s[i] = buf;
+				snprintf(buf, sizeof buf, "metrics/eu-west-1/host-0042/2020-03-11T%09d", nearly[i]);
+				nearly_s[i] = buf;
+			}
+			std::cout << "bench_finger: " << n << " keys\n";
+			bench_finger_keys("int sorted", sorted);
+			bench_finger_keys("int nearly", nearly);
+			bench_finger_keys("string sorted", sorted_s);
+			bench_finger_keys("string nearly", nearly_s);
 		}
-}; //end of class def
\ No newline at end of file
+
+		//word frequencies over the tokens of filename, read passes times:
+		//contains() + get() + put() per token versus one upsert()
+		static void bench_upsert(const std::string& filename, int passes)
+		{
+			char buf[BUFSIZ];
+			std::ifstream ifs(filename);
+			if (!ifs.is_open())
+			{
+				std::cerr << "Could not open file: '" << filename << "'\n";  exit(2);
+			}
+			std::vector<std::string> words;
+			std::string s;
+			while (ifs >> s)
+			{
+				strcpy(buf, s.c_str());
+				strconvert(buf, tolower);
+				strstrip(buf);
+				if (buf[0] != '\0')
+				{
+					words.push_back(buf);
+				}
+			}
+
+			typedef bst_redblack<std::string, int, Alloc, counted_compare<std::string>> counted;
+			long calls[2] = { 0, 0 };
+			double secs[2];
+			counted lookup_put{counted_compare<std::string>(&calls[0])};
+			counted upserted{counted_compare<std::string>(&calls[1])};
+			stopwatch sw;
+			for(int p = 0; p < passes; ++p)
+			{
+				for(const std::string& w : words)
+				{
+					int n = lookup_put.contains(w) ? lookup_put.get(w) : 0;
+					lookup_put.put(w, n + 1);
+				}
+			}
+			secs[0] = sw.seconds();
+			sw.reset();
+			for(int p = 0; p < passes; ++p)
+			{
+				for(const std::string& w : words)
+				{
+					upserted.upsert(w, [](int& n) { ++n; });
+				}
+			}
+			secs[1] = sw.seconds();
+			for(auto it = upserted.begin(); it != upserted.end(); ++it)
+			{
+				if(lookup_put.get(it.key()) != it.value())
+				{
+					throw new std::logic_error("bench_upsert: counts differ");
+				}
+			}
+
+			double t = (double)words.size() * passes;
+			std::cout << "bench_upsert: '" << filename << "', " << (long)t << " tokens, "
+			          << upserted.size() << " distinct\n";
+			const char* name[2] = { "contains+get+put", "upsert" };
+			for(int m = 0; m < 2; ++m)
+			{
+				std::cout << "  " << std::left << std::setw(17) << name[m] << std::right
+				          << std::setw(7) << std::setprecision(3) << secs[m] * 1e9 / t << " ns/token  "
+				          << std::setw(6) << calls[m] / t << " compares/token\n";
+			}
+		}
+
+		//startup cost of a table built from the tokens of filename, read
+		//copies times (copy c > 0 suffixes its keys with "/c"): ingesting the
+		//text as test_bst() does, versus load() and opening a mapped_st on
+		//its snapshot
+		static void bench_snapshot(const std::string& filename, int copies)
+		{
+			typedef bst_redblack<std::string, int> table;
+			char buf[BUFSIZ];
+			stopwatch sw;
+			table st;
+			int i = 0;
+			for(int c = 0; c < copies; ++c)
+			{
+				std::ifstream ifs(filename);
+				if (!ifs.is_open())
+				{
+					std::cerr << "Could not open file: '" << filename << "'\n";  exit(2);
+				}
+				std::string s;
+				while (ifs >> s)
+				{
+					strcpy(buf, s.c_str());
+					strconvert(buf, tolower);
+					strstrip(buf);
+					std::string key = std::string(buf);
+					if (key != "")
+					{
+						st.put(c == 0 ? key : key + "/" + std::to_string(c), ++i);
+					}
+				}
+			}
+			double ingest = sw.seconds();
+
+			std::string path = filename + ".snap";
+			sw.reset();
+			st.save(path);
+			double save = sw.seconds();
+			sw.reset();
+			table loaded = table::load(path);
+			double load = sw.seconds();
+			sw.reset();
+			mapped_st<std::string, int> mapped(path);
+			double map = sw.seconds();
+			sw.reset();
+			mapped_st<std::string, int> trusted(path, false);
+			double map_trusted = sw.seconds();
+
+			for(auto it = st.begin(); it != st.end(); ++it)
+			{
+				if(loaded.get(it.key()) != it.value() || mapped.get(it.key()) != it.value())
+				{
+					throw new std::logic_error("bench_snapshot: snapshot disagrees with the table");
+				}
+			}
+			size_t bytes = mapped.bytes();
+			std::remove(path.c_str());
+
+			std::cout << "bench_snapshot: '" << filename << "' x" << copies << ", " << i << " tokens, "
+			          << st.size() << " keys, snapshot " << bytes / 1024 << " KiB\n" << std::fixed << std::setprecision(2)
+			          << "  text ingestion (test_bst)  " << std::setw(9) << ingest * 1000 << " ms\n"
+			          << "  save()                     " << std::setw(9) << save * 1000 << " ms\n"
+			          << "  load() (linear build)      " << std::setw(9) << load * 1000 << " ms\n"
+			          << "  mapped_st, checksummed     " << std::setw(9) << map * 1000 << " ms\n"
+			          << "  mapped_st, unverified      " << std::setw(9) << map_trusted * 1000 << " ms\n";
+		}
+
+		//n shuffled int puts then n random gets, timed without and with
+		//counting_stats, followed by the counters as JSON
+		static void bench_stats(int n)
+		{
+			std::vector<int> ks(n), qs(n);
+			for(int i = 0; i < n; ++i)
+			{
+				ks[i] = i + 1;
+			}
+			std::mt19937 gen(20200311);
+			std::shuffle(ks.begin(), ks.end(), gen);
+			for(int& q : qs)
+			{
+				q = (int)(gen() % (unsigned)(2 * n)) + 1;
+			}
+			std::cout << "bench_stats: " << n << " shuffled puts, " << n << " random gets\n";
+			bst_redblack<int, int, Alloc> plain;
+			bst_redblack<int, int, Alloc, three_way<int>, no_aggregate, counting_stats> counted;
+			double t[2][2];
+			long sum[2] = { 0, 0 };
+			stopwatch sw;
+			for(int k : ks) { plain.put(k, k); }
+			t[0][0] = sw.seconds();
+			sw.reset();
+			for(int q : qs) { sum[0] += plain.get(q); }
+			t[0][1] = sw.seconds();
+			sw.reset();
+			for(int k : ks) { counted.put(k, k); }
+			t[1][0] = sw.seconds();
+			sw.reset();
+			for(int q : qs) { sum[1] += counted.get(q); }
+			t[1][1] = sw.seconds();
+			if(sum[0] != sum[1])
+			{
+				throw new std::logic_error("bench_stats: results differ");
+			}
+			const char* name[2] = { "no_stats", "counting_stats" };
+			for(int m = 0; m < 2; ++m)
+			{
+				std::cout << "  " << std::left << std::setw(15) << name[m] << std::right
+				          << std::fixed << std::setprecision(1)
+				          << " put " << std::setw(6) << t[m][0] * 1e9 / n << " ns"
+				          << "  get " << std::setw(6) << t[m][1] * 1e9 / n << " ns\n";
+			}
+			std::cout << "  ";
+			counted.stats().to_json(std::cout);
+			std::cout << "\n";
+		}
+
+		//random get() on n int and n std::string keys, with the three_way
+		//policy versus the old per-node compare(): two calls through a
+		//virtual comparator<Key>
+		static void bench_compare(int n)
+		{
+			std::cout << "bench_compare: " << n << " keys, random hits\n";
+			std::vector<int> ik(n);
+			std::vector<std::string> sk(n);
+			for(int i = 0; i < n; ++i)
+			{
+				ik[i] = i + 1;
+				sk[i] = "key/" + std::to_string((long)i * 2654435761L % 1000000007L);
+			}
+			bench_compare_keys("int", ik);
+			bench_compare_keys("std::string", sk);
+		}
+
+	private:
+		//three_way that counts its calls
+		template <typename K>
+		struct counted_compare
+		{
+			counted_compare(long* calls_ = nullptr) : calls(calls_) { }
+			int operator()(const K& a, const K& b) const
+			{
+				++*calls;
+				return three_way<K>()(a, b);
+			}
+			long* calls;
+		};
+
+		//ns per key (best of three runs) and comparisons per key for one way
+		//of inserting ks: 0 put(), 1 chained put_hint(), 2 auto finger
+		template <typename Tree, typename K, typename C>
+		static double time_finger(int mode, const std::vector<K>& ks, const C& comp)
+		{
+			double best = 1e30;
+			for(int rep = 0; rep < 3; ++rep)
+			{
+				Tree st(comp);
+				st.set_auto_finger(mode == 2);
+				typename Tree::iterator hint = st.end();
+				stopwatch sw;
+				for(const K& k : ks)
+				{
+					if(mode == 1)
+					{
+						hint = st.put_hint(hint, k, 1);
+					} else {
+						st.put(k, 1);
+					}
+				}
+				best = std::min(best, sw.seconds() * 1e9 / ks.size());
+				if(st.size() != (int)ks.size())
+				{
+					throw new std::logic_error("bench_finger: lost keys");
+				}
+			}
+			return best;
+		}
+
+		template <typename K>
+		static void bench_finger_keys(const char* name, const std::vector<K>& ks)
+		{
+			typedef bst_redblack<K, int, Alloc> tree;
+			typedef bst_redblack<K, int, Alloc, counted_compare<K>> counted;
+			static const char* modes[] = { "put", "put_hint", "auto finger" };
+			std::cout << "  " << name << "\n";
+			for(int mode = 0; mode < 3; ++mode)
+			{
+				long calls = 0;
+				double ns = time_finger<tree>(mode, ks, three_way<K>());
+				time_finger<counted>(mode, ks, counted_compare<K>(&calls));
+				std::cout << std::setw(16) << modes[mode] << ": " << std::setw(7) << ns << " ns  "
+				          << std::setw(5) << calls / (3.0 * ks.size()) << " compares/key\n";
+			}
+		}
+
+		//the pre-policy comparison: less() twice through a comparator<K>&
+		template <typename K>
+		struct virtual_compare
+		{
+			virtual_compare() : less_(std::make_shared<fwd_comparator<K>>()) { }
+			int operator()(const K& a, const K& b) const
+			{
+				const comparator<K>& c = *less_;
+				return compare(a, b, c);
+			}
+			std::shared_ptr<const comparator<K>> less_;
+		};
+
+		template <typename Tree, typename K>
+		static double time_gets(std::vector<K> ks, long& hits)
+		{
+			Tree st;
+			for(size_t i = 0; i < ks.size(); ++i)
+			{
+				st.put(ks[i], (int)i + 1);
+			}
+			std::shuffle(ks.begin(), ks.end(), std::mt19937(7));
+			stopwatch sw;
+			for(int rep = 0; rep < 4; ++rep)
+			{
+				for(const K& k : ks) { hits += st.get(k) != 0; }
+			}
+			return sw.seconds() * 1e9 / (4.0 * ks.size());
+		}
+
+		template <typename K>
+		static void bench_compare_keys(const char* name, const std::vector<K>& ks)
+		{
+			long h1 = 0, h2 = 0;
+			double t_virtual = time_gets<bst_redblack<K, int, Alloc, virtual_compare<K>>>(ks, h1);
+			double t_policy = time_gets<bst_redblack<K, int, Alloc>>(ks, h2);
+			if(h1 != h2)
+			{
+				throw new std::logic_error("bench_compare: policies disagree");
+			}
+			std::cout << std::setw(12) << name
+			          << "  virtual less() x2: " << std::setw(7) << t_virtual << " ns/lookup"
+			          << "  three_way: " << std::setw(7) << t_policy << " ns/lookup\n";
+		}
+}; //end of class def
+
+#endif /* bst_redblack_h */
@@ -0,0 +1,152 @@
+//
+//  bst_redblack_bench.h
+//  sqb
+//
+//  Benchmarks that set bst_redblack against other structures or need a
+//  process of their own. They live here so that bst_redblack.h depends
+//  only on what the tree itself uses: bench_alloc and compact_memory_report
+//  fork one process per measurement, and bench_delete_range compares
+//  against bst.
+//
+
+#ifndef bst_redblack_bench_h
+#define bst_redblack_bench_h
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bst.h"
+#include "bst_redblack.h"
+#include "bst_redblack_compact.h"
+#include "node_arena.h"
+#include "queue.h"
+#include "utils.h"
+
+
+//---------------------------------------------------------
+template <typename Tree>
+void bench_alloc_tree(const char* name, const std::vector<int>& ks) {
+  size_t rss_before = current_rss_kb();
+  Tree* st = new Tree();
+  stopwatch sw;
+  for (int k : ks) { st->put(k, k); }
+  double insert_s = sw.seconds();
+  size_t rss_after = current_rss_kb();
+
+  sw.reset();
+  delete st;
+  double teardown_s = sw.seconds();
+
+  std::cout << std::setw(12) << name
+            << "  inserts/s: " << std::setw(10) << (long)(ks.size() / insert_s)
+            << "  RSS +" << std::setw(5) << (rss_after - rss_before) / 1024 << " MB"
+            << "  teardown: " << teardown_s * 1000 << " ms" << std::endl;
+}
+
+// insert throughput, RSS growth and teardown time for n shuffled int keys,
+// with plain new/delete nodes versus the default node_arena
+inline void bench_alloc(int n) {
+  std::vector<int> ks(n);
+  for (int i = 0; i < n; ++i) { ks[i] = i + 1; }
+  std::shuffle(ks.begin(), ks.end(), std::mt19937(20200311));
+
+  std::cout << "bench_alloc: " << n << " shuffled int keys\n";
+  // each policy runs in its own process so RSS readings don't overlap
+  std::cout.flush();
+  if (fork() == 0) {
+    bench_alloc_tree<bst_redblack<int, int, heap_node_alloc>>("new/delete", ks);
+    exit(0);
+  }
+  wait(nullptr);
+  if (fork() == 0) {
+    bench_alloc_tree<bst_redblack<int, int, node_arena>>("node_arena", ks);
+    exit(0);
+  }
+  wait(nullptr);
+}
+
+// bytes per key for n int keys, bst_redblack's pointer layout versus
+// bst_redblack_compact's index layout; each build runs in a child process
+// so the RSS deltas are independent
+inline void compact_memory_report(int n) {
+  std::cout << "memory_report: " << n << " int keys\n";
+  std::cout << "  sizeof node:  bst_redblack " << bst_redblack<int, int>::bytes_per_node()
+            << ",  bst_redblack_compact " << bst_redblack_compact<int, int>::bytes_per_node() << "\n";
+  std::cout.flush();
+  if (fork() == 0) {
+    size_t before = current_rss_kb();
+    bst_redblack<int, int>* st = new bst_redblack<int, int>();
+    for (int i = 1; i <= n; ++i) { st->put(i, i); }
+    std::cout << "  bst_redblack:         " << (current_rss_kb() - before) * 1024.0 / n << " bytes/key" << std::endl;
+    exit(0);
+  }
+  wait(nullptr);
+  if (fork() == 0) {
+    size_t before = current_rss_kb();
+    bst_redblack_compact<int, int>* st = new bst_redblack_compact<int, int>();
+    for (int i = 1; i <= n; ++i) { st->put(i, i); }
+    std::cout << "  bst_redblack_compact: " << (current_rss_kb() - before) * 1024.0 / n << " bytes/key"
+              << " (vector capacity " << st->capacity() << ")" << std::endl;
+    exit(0);
+  }
+  wait(nullptr);
+}
+
+
+//---------------------------------------------------------
+// n shuffled int keys, then the middle k of them removed: keys() and one
+// delete per key versus delete_range(), on bst_redblack and bst. Build
+// with NDEBUG: bst runs its O(n) check() after every change
+template <template <typename> class Alloc = node_arena>
+void bench_delete_range(int n, int k) {
+  std::vector<int> ks(n);
+  for (int i = 0; i < n; ++i) { ks[i] = i + 1; }
+  std::mt19937 gen(20200311);
+  std::shuffle(ks.begin(), ks.end(), gen);
+  int low = (n - k) / 2 + 1, high = low + k - 1;
+  std::cout << "bench_delete_range: " << n << " keys, removing [" << low << ", " << high << "]\n";
+
+  double t[4];
+  int removed[4];
+  for (int m = 0; m < 4; ++m) {
+    bst_redblack<int, int, Alloc> rb;
+    bst<int, int> b;
+    for (int x : ks) {
+      if (m < 2) { rb.put(x, x); } else { b.put(x, x); }
+    }
+    stopwatch sw;
+    if (m == 0) {
+      array_queue<int> q = rb.keys(low, high);
+      removed[m] = 0;
+      for (int x : q) { rb.delete_(x);  ++removed[m]; }
+    } else if (m == 1) {
+      removed[m] = rb.delete_range(low, high);
+    } else if (m == 2) {
+      array_queue<int> q = b.keys(low, high);
+      removed[m] = 0;
+      for (int x : q) { b.delete_key(x);  ++removed[m]; }
+    } else {
+      removed[m] = b.delete_range(low, high);
+    }
+    t[m] = sw.seconds();
+    int left = (m < 2 ? rb.size() : b.size());
+    if (removed[m] != k || left != n - k) {
+      throw new std::logic_error("bench_delete_range: wrong keys removed");
+    }
+  }
+  const char* name[4] = { "bst_redblack keys + delete_", "bst_redblack delete_range",
+                          "bst keys + delete_key", "bst delete_range" };
+  for (int m = 0; m < 4; ++m) {
+    std::cout << "  " << std::left << std::setw(28) << name[m] << std::right << std::fixed
+              << std::setprecision(3) << std::setw(9) << t[m] * 1000 << " ms\n";
+  }
+}
+
+
+#endif /* bst_redblack_bench_h */
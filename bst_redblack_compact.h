@@ -0,0 +1,352 @@
+//
+//  bst_redblack_compact.h
+//  sqb
+//
+//  Left-leaning red-black tree with the same public API as bst_redblack,
+//  but with every node stored in one contiguous vector. Children are 32-bit
+//  indices into that vector (0 is the null link) and the color bit lives in
+//  the top bit of the subtree size, so a node costs key + value + 12 bytes
+//  instead of key + value + two pointers + color + size + padding.
+//
+
+#ifndef bst_redblack_compact_h
+#define bst_redblack_compact_h
+
+#include <algorithm>
+#include <iostream>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include "queue.h"
+#include "utils.h"
+
+
+template <typename Key, typename Value>
+class bst_redblack_compact {
+private:
+  typedef uint32_t link;
+  static const link NIL = 0;
+  static const uint32_t RED_BIT  = 0x80000000u;
+  static const uint32_t SIZE_MASK = 0x7fffffffu;
+
+  struct node {
+    Key key;
+    Value val;
+    link left;
+    link right;
+    uint32_t size_color;   // bit 31: red, bits 0..30: subtree size
+
+    node(const Key& key_, const Value& val_)
+    : key(key_), val(val_), left(NIL), right(NIL), size_color(RED_BIT | 1) { }
+  };
+
+  std::vector<node> nodes_;    // nodes_[0] is never used so that 0 can mean null
+  link root_;
+  link free_;                  // deleted slots, chained through left
+
+public:
+  bst_redblack_compact() : root_(NIL), free_(NIL) { nodes_.reserve(16);  nodes_.emplace_back(Key(), Value()); }
+
+  static size_t bytes_per_node() { return sizeof(node); }
+  size_t capacity() const { return nodes_.capacity(); }
+
+  int size() { return size(root_); }
+  bool empty() { return root_ == NIL; }
+  bool is_empty() { return empty(); }
+
+  void clear() {
+    nodes_.resize(1);
+    root_ = free_ = NIL;
+  }
+
+  //-------- search -------------------------------------------------------------
+  Value get(const Key& k) {
+    if (k == Key()) { throw new std::invalid_argument("argument to get() is null"); }
+    link x = root_;
+    while (x != NIL) {
+      const node& n = nodes_[x];
+      if      (k < n.key) { x = n.left; }
+      else if (n.key < k) { x = n.right; }
+      else                { return n.val; }
+    }
+    return Value();
+  }
+
+  bool contains(const Key& k) { return get(k) != Value(); }
+
+  //-------- insertion ----------------------------------------------------------
+  void put(const Key& k, const Value& v) {
+    if (k == Key()) { throw new std::invalid_argument("first argument to put() is null"); }
+    if (v == Value()) { delete_(k);  return; }
+    root_ = put(root_, k, v);
+    set_black(root_);
+  }
+
+private:
+  link put(link h, const Key& k, const Value& v) {
+    if (h == NIL) { return new_node(k, v); }
+
+    if (k < nodes_[h].key)      { link t = put(nodes_[h].left,  k, v);  nodes_[h].left  = t; }
+    else if (nodes_[h].key < k) { link t = put(nodes_[h].right, k, v);  nodes_[h].right = t; }
+    else                        { nodes_[h].val = v; }
+
+    if (is_red(R(h)) && !is_red(L(h)))    { h = rotate_left(h); }
+    if (is_red(L(h)) && is_red(L(L(h))))  { h = rotate_right(h); }
+    if (is_red(L(h)) && is_red(R(h)))     { flip_colors(h); }
+    update(h);
+    return h;
+  }
+
+  //-------- deletion -----------------------------------------------------------
+public:
+  void delete_min() {
+    if (empty()) { throw new std::logic_error("BST underflow"); }
+    if (!is_red(L(root_)) && !is_red(R(root_))) { set_red(root_); }
+    root_ = delete_min(root_);
+    if (!empty()) { set_black(root_); }
+  }
+
+  void delete_max() {
+    if (empty()) { throw new std::logic_error("BST underflow"); }
+    if (!is_red(L(root_)) && !is_red(R(root_))) { set_red(root_); }
+    root_ = delete_max(root_);
+    if (!empty()) { set_black(root_); }
+  }
+
+  // one descent whether or not k is there; returns whether it was
+  bool delete_(const Key& k) {
+    if (k == Key()) { throw new std::invalid_argument("argument to delete_() is null"); }
+    if (empty()) { return false; }
+    if (!is_red(L(root_)) && !is_red(R(root_))) { set_red(root_); }
+    bool found = false;
+    root_ = delete_(root_, k, found);
+    if (!empty()) { set_black(root_); }
+    return found;
+  }
+
+private:
+  link delete_min(link h) {
+    if (L(h) == NIL) { free_node(h);  return NIL; }
+    if (!is_red(L(h)) && !is_red(L(L(h)))) { h = move_red_left(h); }
+    link t = delete_min(L(h));
+    nodes_[h].left = t;
+    return balance(h);
+  }
+
+  link delete_max(link h) {
+    if (is_red(L(h))) { h = rotate_right(h); }
+    if (R(h) == NIL) { free_node(h);  return NIL; }
+    if (!is_red(R(h)) && !is_red(L(R(h)))) { h = move_red_right(h); }
+    link t = delete_max(R(h));
+    nodes_[h].right = t;
+    return balance(h);
+  }
+
+  // a missing k ends the descent at a null link; the nodes moved red on
+  // the way down are rebalanced on the way back up as usual
+  link delete_(link h, const Key& k, bool& found) {
+    if (k < nodes_[h].key) {
+      if (L(h) == NIL) { return balance(h); }
+      if (!is_red(L(h)) && !is_red(L(L(h)))) { h = move_red_left(h); }
+      link t = delete_(L(h), k, found);
+      nodes_[h].left = t;
+    } else {
+      if (is_red(L(h))) { h = rotate_right(h); }
+      if (R(h) == NIL) {
+        if (nodes_[h].key < k) { return balance(h); }
+        free_node(h);
+        found = true;
+        return NIL;
+      }
+      if (!is_red(R(h)) && !is_red(L(R(h)))) { h = move_red_right(h); }
+      if (!(nodes_[h].key < k)) {
+        link m = min(R(h));
+        nodes_[h].key = nodes_[m].key;
+        nodes_[h].val = nodes_[m].val;
+        link t = delete_min(R(h));
+        nodes_[h].right = t;
+        found = true;
+      } else {
+        link t = delete_(R(h), k, found);
+        nodes_[h].right = t;
+      }
+    }
+    return balance(h);
+  }
+
+  //-------- node storage and red-black helpers ---------------------------------
+  link new_node(const Key& k, const Value& v) {
+    if (free_ != NIL) {
+      link x = free_;
+      free_ = nodes_[x].left;
+      nodes_[x] = node(k, v);
+      return x;
+    }
+    if (nodes_.size() > SIZE_MASK) { throw new std::overflow_error("bst_redblack_compact is full"); }
+    nodes_.emplace_back(k, v);
+    return (link)(nodes_.size() - 1);
+  }
+  void free_node(link x) {
+    nodes_[x].key = Key();
+    nodes_[x].val = Value();
+    nodes_[x].left = free_;
+    free_ = x;
+  }
+
+  link L(link x) const { return nodes_[x].left; }
+  link R(link x) const { return nodes_[x].right; }
+  int size(link x) const { return x == NIL ? 0 : (int)(nodes_[x].size_color & SIZE_MASK); }
+  bool is_red(link x) const { return x != NIL && (nodes_[x].size_color & RED_BIT) != 0; }
+  void set_red(link x)   { nodes_[x].size_color |= RED_BIT; }
+  void set_black(link x) { nodes_[x].size_color &= SIZE_MASK; }
+  void set_color(link x, bool red) { if (red) { set_red(x); } else { set_black(x); } }
+  void update(link x) {
+    node& n = nodes_[x];
+    n.size_color = (n.size_color & RED_BIT) | (uint32_t)(size(n.left) + size(n.right) + 1);
+  }
+
+  link rotate_right(link h) {
+    link x = L(h);
+    nodes_[h].left = R(x);
+    nodes_[x].right = h;
+    set_color(x, is_red(h));
+    set_red(h);
+    update(h);
+    update(x);
+    return x;
+  }
+  link rotate_left(link h) {
+    link x = R(h);
+    nodes_[h].right = L(x);
+    nodes_[x].left = h;
+    set_color(x, is_red(h));
+    set_red(h);
+    update(h);
+    update(x);
+    return x;
+  }
+  void flip_colors(link h) {
+    nodes_[h].size_color ^= RED_BIT;
+    nodes_[L(h)].size_color ^= RED_BIT;
+    nodes_[R(h)].size_color ^= RED_BIT;
+  }
+  link move_red_left(link h) {
+    flip_colors(h);
+    if (is_red(L(R(h)))) {
+      nodes_[h].right = rotate_right(R(h));
+      h = rotate_left(h);
+      flip_colors(h);
+    }
+    return h;
+  }
+  link move_red_right(link h) {
+    flip_colors(h);
+    if (is_red(L(L(h)))) {
+      h = rotate_right(h);
+      flip_colors(h);
+    }
+    return h;
+  }
+  link balance(link h) {
+    if (is_red(R(h)))                     { h = rotate_left(h); }
+    if (is_red(L(h)) && is_red(L(L(h))))  { h = rotate_right(h); }
+    if (is_red(L(h)) && is_red(R(h)))     { flip_colors(h); }
+    update(h);
+    return h;
+  }
+
+  //-------- ordered symbol table functions -------------------------------------
+public:
+  Key min() {
+    if (empty()) { throw new std::logic_error("calls min() with empty symbol table"); }
+    return nodes_[min(root_)].key;
+  }
+  Key max() {
+    if (empty()) { throw new std::logic_error("calls max() with empty symbol table"); }
+    link x = root_;
+    while (R(x) != NIL) { x = R(x); }
+    return nodes_[x].key;
+  }
+private:
+  link min(link x) const {
+    while (L(x) != NIL) { x = L(x); }
+    return x;
+  }
+
+public:
+  Key floor(const Key& k) {
+    if (empty()) { throw new std::logic_error("calls floor() with empty symbol table"); }
+    link x = root_, best = NIL;
+    while (x != NIL) {
+      if      (k < nodes_[x].key) { x = L(x); }
+      else if (nodes_[x].key < k) { best = x;  x = R(x); }
+      else                        { return nodes_[x].key; }
+    }
+    if (best == NIL) { throw new std::logic_error("argument to floor() is too small"); }
+    return nodes_[best].key;
+  }
+
+  Key ceiling(const Key& k) {
+    if (empty()) { throw new std::logic_error("calls ceiling() with empty symbol table"); }
+    link x = root_, best = NIL;
+    while (x != NIL) {
+      if      (k < nodes_[x].key) { best = x;  x = L(x); }
+      else if (nodes_[x].key < k) { x = R(x); }
+      else                        { return nodes_[x].key; }
+    }
+    if (best == NIL) { throw new std::logic_error("argument to ceiling() is too large"); }
+    return nodes_[best].key;
+  }
+
+  Key select(int rank) {
+    if (rank < 0 || rank >= size()) { throw new std::invalid_argument("invalid select"); }
+    link x = root_;
+    while (true) {
+      int left_size = size(L(x));
+      if      (left_size > rank) { x = L(x); }
+      else if (left_size < rank) { rank -= left_size + 1;  x = R(x); }
+      else                       { return nodes_[x].key; }
+    }
+  }
+
+  int rank(const Key& k) {
+    int r = 0;
+    link x = root_;
+    while (x != NIL) {
+      if      (k < nodes_[x].key) { x = L(x); }
+      else if (nodes_[x].key < k) { r += size(L(x)) + 1;  x = R(x); }
+      else                        { return r + size(L(x)); }
+    }
+    return r;
+  }
+
+  array_queue<Key> keys() {
+    array_queue<Key> q;
+    if (!empty()) { keys(root_, q, min(), max()); }
+    return q;
+  }
+  array_queue<Key> keys(const Key& low, const Key& high) {
+    array_queue<Key> q;
+    keys(root_, q, low, high);
+    return q;
+  }
+
+  int height() { return height(root_); }
+
+private:
+  void keys(link x, queue_<Key>& q, const Key& low, const Key& high) {
+    if (x == NIL) { return; }
+    bool low_le  = !(nodes_[x].key < low);
+    bool high_ge = !(high < nodes_[x].key);
+    if (low_le)            { keys(L(x), q, low, high); }
+    if (low_le && high_ge) { q.enqueue(nodes_[x].key); }
+    if (high_ge)           { keys(R(x), q, low, high); }
+  }
+  int height(link x) {
+    if (x == NIL) { return -1; }
+    return 1 + std::max(height(L(x)), height(R(x)));
+  }
+};
+
+
+#endif /* bst_redblack_compact_h */
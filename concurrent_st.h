@@ -0,0 +1,213 @@
+//
+//  concurrent_st.h
+//  sqb
+//
+//  Ordered symbol table for many readers and serialized writers.
+//
+//  Writers take a mutex, update a bst_persistent and publish an immutable
+//  version of it with a single atomic pointer swap. Readers load the
+//  current version inside an epoch guard and query it without locks and
+//  without touching reference counts; a replaced version is retired to the
+//  epoch domain and dropped once no reader can still be looking at it.
+//
+
+#ifndef concurrent_st_h
+#define concurrent_st_h
+
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "bst_persistent.h"
+#include "bst_redblack.h"
+#include "epoch.h"
+#include "utils.h"
+
+
+template <typename Key, typename Value>
+class concurrent_st {
+public:
+  typedef typename bst_persistent<Key, Value>::version version;
+
+  concurrent_st() : current_(new version()) { }
+  concurrent_st(const concurrent_st&) = delete;
+  concurrent_st& operator=(const concurrent_st&) = delete;
+  ~concurrent_st() { delete current_.load(); }
+
+  //-------- lock-free reads ---------------------------------------------------------
+  int size() const      { return read([](const version& v) { return v.size(); }); }
+  bool is_empty() const { return size() == 0; }
+  Value get(const Key& k) const  { return read([&](const version& v) { return v.get(k); }); }
+  bool contains(const Key& k) const { return get(k) != Value(); }
+  Key min() const       { return read([](const version& v) { return v.min(); }); }
+  Key max() const       { return read([](const version& v) { return v.max(); }); }
+  int rank(const Key& k) const   { return read([&](const version& v) { return v.rank(k); }); }
+  Key select(int r) const        { return read([&](const version& v) { return v.select(r); }); }
+  array_queue<Key> keys(const Key& low, const Key& high) const {
+    return read([&](const version& v) { return v.keys(low, high); });
+  }
+
+  // a version that stays valid (and unchanged) for as long as it is held,
+  // for callers that need several consistent queries
+  version snapshot() const { return read([](const version& v) { return v; }); }
+
+  //-------- serialized writes -------------------------------------------------------
+  void put(const Key& k, const Value& v) {
+    std::lock_guard<std::mutex> lock(writer_);
+    st_.put(k, v);
+    publish();
+  }
+
+  // publishes a new version only if k was there
+  bool delete_(const Key& k) {
+    std::lock_guard<std::mutex> lock(writer_);
+    if (!st_.delete_(k)) { return false; }
+    publish();
+    return true;
+  }
+
+private:
+  template <typename F>
+  auto read(F f) const -> decltype(f(std::declval<const version&>())) {
+    epoch_domain::guard g(epochs_);
+    return f(*current_.load());
+  }
+
+  void publish() {
+    version* old = current_.exchange(new version(st_.snapshot()));
+    epochs_.retire(old);
+  }
+
+  bst_persistent<Key, Value> st_;
+  std::atomic<version*> current_;
+  std::mutex writer_;
+  mutable epoch_domain epochs_;
+
+  //-------- stress test and benchmark ------------------------------------------------
+public:
+  // writers slide a window of keys [lo, lo + w) forward while readers check
+  // that every answer they get is consistent with one such window
+  static void stress_test(int readers, int writers, int steps) {
+    std::cout << "concurrent_st stress_test: " << readers << " readers, " << writers << " writers\n";
+    const int w = 512;
+    concurrent_st<int, int> st;
+    for (int k = 1; k <= w; ++k) { st.put(k, k); }
+    std::mutex step_lock;
+    int next = 1;
+    std::atomic<bool> stop(false);
+    std::atomic<long> checks(0);
+
+    std::vector<std::thread> ts;
+    for (int i = 0; i < writers; ++i) {
+      ts.emplace_back([&] {
+        while (true) {
+          std::lock_guard<std::mutex> lock(step_lock);     // one slide at a time
+          if (next > steps) { return; }
+          st.put(next + w, next + w);
+          st.delete_(next);
+          ++next;
+        }
+      });
+    }
+    for (int i = 0; i < readers; ++i) {
+      ts.emplace_back([&] {
+        long done = 0;
+        while (!stop.load()) {
+          version v = st.snapshot();
+          int n = v.size();
+          if (n != w && n != w + 1) { throw new std::logic_error("stress_test: bad size"); }
+          int lo = v.min(), hi = v.max();
+          if (hi - lo + 1 != n || v.select(n - 1) != hi || v.rank(hi) != n - 1) {
+            throw new std::logic_error("stress_test: inconsistent version");
+          }
+          int k = lo + (int)(done % n);
+          if (v.get(k) != k) { throw new std::logic_error("stress_test: missing key"); }
+          int g = st.get(k);                               // may see a newer version
+          if (g != k && g != 0) { throw new std::logic_error("stress_test: bad value"); }
+          ++done;
+        }
+        checks += done;
+      });
+    }
+    for (int i = 0; i < writers; ++i) { ts[i].join(); }
+    stop = true;
+    for (size_t i = writers; i < ts.size(); ++i) { ts[i].join(); }
+
+    if (st.size() != w || st.min() != steps + 1 || st.max() != steps + w) {
+      throw new std::logic_error("stress_test: wrong final contents");
+    }
+    std::cout << "  " << steps << " slides, " << checks << " reader checks: ok\n";
+  }
+
+  // read throughput for 1, 2, 4, ... reader threads next to one writer,
+  // against a single mutex around bst_redblack
+  static void bench_scaling(int n, double seconds) {
+    std::cout << "concurrent_st bench_scaling: " << n << " keys, 1 writer\n";
+    int hw = (int)std::max(1u, std::thread::hardware_concurrency());
+    for (int readers = 1; readers <= hw; readers *= 2) {
+      double locked = bench<true>(n, readers, seconds);
+      double lockfree = bench<false>(n, readers, seconds);
+      std::cout << "  readers " << std::setw(3) << readers
+                << "  mutex+bst_redblack reads/s " << std::setw(11) << (long)locked
+                << "  concurrent_st reads/s " << std::setw(11) << (long)lockfree << "\n";
+    }
+  }
+
+private:
+  template <bool Locked>
+  static double bench(int n, int readers, double seconds) {
+    concurrent_st<int, int> st;
+    bst_redblack<int, int> plain;
+    std::mutex lock;
+    for (int k = 1; k <= n; ++k) {
+      if (Locked) { plain.put(k, k); } else { st.put(k, k); }
+    }
+    std::atomic<bool> stop(false);
+    std::atomic<long> reads(0), hits(0);
+
+    std::thread writer([&] {
+      for (int i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+        int k = i % n + 1;
+        if (Locked) {
+          std::lock_guard<std::mutex> guard(lock);
+          plain.delete_(k);
+          plain.put(k, k);
+        } else {
+          st.delete_(k);
+          st.put(k, k);
+        }
+      }
+    });
+    std::vector<std::thread> rs;
+    for (int r = 0; r < readers; ++r) {
+      rs.emplace_back([&, r] {
+        long done = 0, found = 0;
+        unsigned x = 2463534242u + r;
+        while (!stop.load(std::memory_order_relaxed)) {
+          x ^= x << 13;  x ^= x >> 17;  x ^= x << 5;
+          int k = (int)(x % n) + 1;
+          if (Locked) {
+            std::lock_guard<std::mutex> guard(lock);
+            found += plain.get(k) != 0;
+          } else {
+            found += st.get(k) != 0;
+          }
+          ++done;
+        }
+        reads += done;
+        hits += found;
+      });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    writer.join();
+    for (std::thread& t : rs) { t.join(); }
+    return reads / seconds;
+  }
+};
+
+
+#endif /* concurrent_st_h */
@@ -0,0 +1,401 @@
+//
+//  durable_st.h
+//  sqb
+//
+//  Durable ordered symbol table: a bst_redblack index, a write-ahead log
+//  and snapshots (see st_snapshot.h).
+//
+//  Every put/delete_ is applied to the tree and appended to an in-memory
+//  batch; once group_commit mutations are pending (or on commit()) the
+//  batch is written to the log with one write() and made durable with one
+//  fsync, so the fsync cost is shared by the whole group. A mutation is
+//  durable once the commit that covers it returns. checkpoint() commits,
+//  saves the tree as a snapshot (written beside the old one, fsynced and
+//  renamed over it) and then truncates the log.
+//
+//  Opening a directory recovers it: the snapshot is loaded in linear time
+//  and the log replayed on top. Each log record carries its length and a
+//  checksum, so a record torn by a crash mid-write ends the replay and is
+//  cut off the log. A commit that fails part way cuts its torn prefix off
+//  the same way before the batch is written again. A crash between the
+//  rename and the truncation leaves a log that replays onto the new
+//  snapshot; puts and deletes are idempotent, so that yields the same
+//  table.
+//
+//    record   u32 body length, u32 checksum of the body, then the body:
+//             u8 op (WAL_PUT or WAL_DELETE), key, value (puts only)
+//
+
+#ifndef durable_st_h
+#define durable_st_h
+
+#include <iostream>
+#include <iomanip>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bst_redblack.h"
+#include "st_snapshot.h"
+#include "utils.h"
+
+
+#define WAL_PUT    1
+#define WAL_DELETE 2
+
+//---------------------------------------------------------
+// how one key or value is laid out in a log record
+template <typename T>
+struct wal_codec {
+  static_assert(std::is_trivially_copyable<T>::value, "log records need trivially copyable types or std::string");
+  static void append(std::string& out, const T& x) { out.append(reinterpret_cast<const char*>(&x), sizeof x); }
+  static bool read(const char*& p, const char* end, T& x) {
+    if ((size_t)(end - p) < sizeof x) { return false; }
+    std::memcpy(&x, p, sizeof x);
+    p += sizeof x;
+    return true;
+  }
+};
+
+template <>
+struct wal_codec<std::string> {
+  static void append(std::string& out, const std::string& s) {
+    uint32_t n = (uint32_t)s.size();
+    out.append(reinterpret_cast<const char*>(&n), sizeof n);
+    out.append(s);
+  }
+  static bool read(const char*& p, const char* end, std::string& s) {
+    uint32_t n;
+    if ((size_t)(end - p) < sizeof n) { return false; }
+    std::memcpy(&n, p, sizeof n);
+    p += sizeof n;
+    if ((size_t)(end - p) < n) { return false; }
+    s.assign(p, n);
+    p += n;
+    return true;
+  }
+};
+
+
+//---------------------------------------------------------
+template <typename Key, typename Value>
+class durable_st {
+public:
+  struct metrics {
+    long records;              // mutations logged since open
+    long commits;              // fsyncs of the log
+    long bytes;                // log bytes written
+    double fsync_seconds;      // time spent in those fsyncs
+    long replayed;             // log records replayed by recovery
+    double recovery_seconds;   // snapshot load plus replay
+    double batch() const { return commits == 0 ? 0.0 : (double)records / commits; }
+  };
+
+  explicit durable_st(const std::string& dir, int group_commit = 64)
+  : dir_(dir), group_(group_commit < 1 ? 1 : group_commit), fd_(-1), pending_(0), log_bytes_(0), torn_(false) {
+    std::memset(&metrics_, 0, sizeof metrics_);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) { fail("cannot create " + dir); }
+    recover();
+  }
+
+  durable_st(const durable_st&) = delete;
+  durable_st& operator=(const durable_st&) = delete;
+  ~durable_st() {
+    try { commit(); } catch (std::runtime_error* e) { delete e; }
+    if (fd_ >= 0) { ::close(fd_); }
+  }
+
+  Value get(const Key& k) { return st_.get(k); }
+  bool contains(const Key& k) { return st_.contains(k); }
+  int size() { return st_.size(); }
+  bool is_empty() { return st_.is_empty(); }
+  const metrics& stats() const { return metrics_; }
+
+  // durable after the commit that covers it; as with bst_redblack, a value
+  // equal to Value() deletes k
+  void put(const Key& k, const Value& v) {
+    if (v == Value()) { delete_(k);  return; }
+    st_.put(k, v);
+    log(WAL_PUT, k, &v);
+  }
+
+  void delete_(const Key& k) {
+    if (st_.delete_(k)) { log(WAL_DELETE, k, nullptr); }
+  }
+
+  // writes and fsyncs the pending batch. If that fails, the batch stays
+  // pending and whatever part of it reached the log is cut off by the next
+  // commit, so acknowledged records never end up behind a torn one
+  void commit() {
+    if (batch_.empty()) { return; }
+    if (torn_) {
+      if (ftruncate(fd_, (off_t)log_bytes_) != 0) { fail("cannot cut a failed commit off the log"); }
+      torn_ = false;
+    }
+    torn_ = true;
+    const char* p = batch_.data();
+    size_t left = batch_.size();
+    while (left > 0) {
+      ssize_t w = ::write(fd_, p, left);
+      if (w < 0 && errno == EINTR) { continue; }
+      if (w < 0) { fail("cannot append to the log"); }
+      p += w;
+      left -= (size_t)w;
+    }
+    stopwatch sw;
+    sync_fd(fd_);
+    metrics_.fsync_seconds += sw.seconds();
+    torn_ = false;
+    log_bytes_ += batch_.size();
+    metrics_.bytes += (long)batch_.size();
+    ++metrics_.commits;
+    batch_.clear();
+    pending_ = 0;
+  }
+
+  // snapshot the table and start an empty log
+  void checkpoint() {
+    commit();
+    st_.save(snapshot_path());  // replaces the old snapshot atomically
+    if (ftruncate(fd_, 0) != 0) { fail("cannot truncate the log"); }
+    sync_fd(fd_);
+    log_bytes_ = 0;
+  }
+
+private:
+  std::string snapshot_path() const { return dir_ + "/snapshot"; }
+  std::string wal_path() const { return dir_ + "/wal"; }
+
+  static void fail(const std::string& what) {
+    throw new std::runtime_error(what + ": " + strerror(errno));
+  }
+
+  void sync_dir() { sync_parent_dir(wal_path()); }
+
+  void log(uint8_t op, const Key& k, const Value* v) {
+    size_t at = batch_.size();
+    uint32_t hdr[2] = { 0, 0 };
+    batch_.append(reinterpret_cast<const char*>(hdr), sizeof hdr);
+    batch_.push_back((char)op);
+    wal_codec<Key>::append(batch_, k);
+    if (v != nullptr) { wal_codec<Value>::append(batch_, *v); }
+    const char* body = batch_.data() + at + sizeof hdr;
+    hdr[0] = (uint32_t)(batch_.size() - at - sizeof hdr);
+    hdr[1] = (uint32_t)fnv1a(FNV1A_SEED, body, hdr[0]);
+    std::memcpy(&batch_[at], hdr, sizeof hdr);
+    ++metrics_.records;
+    if (++pending_ >= group_) { commit(); }
+  }
+
+  void recover() {
+    stopwatch sw;
+    if (access(snapshot_path().c_str(), F_OK) == 0) {
+      try {
+        st_ = bst_redblack<Key, Value>::load(snapshot_path());
+      } catch (std::runtime_error* e) {
+        std::string why = e->what();
+        delete e;
+        throw new std::runtime_error("cannot recover " + dir_ + ": " + why);
+      }
+    }
+    fd_ = ::open(wal_path().c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) { fail("cannot open " + wal_path()); }
+    sync_dir();                // the log may have just been created
+
+    std::string wal;
+    char buf[1 << 16];
+    ssize_t r;
+    while ((r = ::read(fd_, buf, sizeof buf)) != 0) {
+      if (r < 0 && errno == EINTR) { continue; }
+      if (r < 0) { fail("cannot read the log"); }
+      wal.append(buf, (size_t)r);
+    }
+
+    const char* p = wal.data();
+    const char* end = p + wal.size();
+    while (true) {
+      uint32_t hdr[2];
+      if ((size_t)(end - p) < sizeof hdr) { break; }
+      std::memcpy(hdr, p, sizeof hdr);
+      const char* body = p + sizeof hdr;
+      if ((size_t)(end - body) < hdr[0] || hdr[0] == 0) { break; }
+      if ((uint32_t)fnv1a(FNV1A_SEED, body, hdr[0]) != hdr[1]) { break; }
+      if (!apply(body, body + hdr[0])) { break; }
+      p = body + hdr[0];
+      ++metrics_.replayed;
+    }
+    // a torn tail is cut off, so new records never follow garbage
+    size_t good = (size_t)(p - wal.data());
+    if (good < wal.size()) {
+      if (ftruncate(fd_, (off_t)good) != 0) { fail("cannot truncate the log"); }
+      sync_fd(fd_);
+    }
+    log_bytes_ = good;
+    metrics_.recovery_seconds = sw.seconds();
+  }
+
+  bool apply(const char* p, const char* end) {
+    uint8_t op = (uint8_t)*p++;
+    Key k;
+    if (!wal_codec<Key>::read(p, end, k)) { return false; }
+    if (op == WAL_DELETE) {
+      st_.delete_(k);
+      return p == end;
+    }
+    Value v;
+    if (op != WAL_PUT || !wal_codec<Value>::read(p, end, v)) { return false; }
+    st_.put(k, v);
+    return p == end;
+  }
+
+  std::string dir_;
+  int group_;
+  int fd_;
+  int pending_;
+  size_t log_bytes_;           // length of the committed log
+  bool torn_;                  // a failed commit may have left part of batch_ in the log
+  std::string batch_;
+  bst_redblack<Key, Value> st_;
+  metrics metrics_;
+
+  //-------- tests and benchmarks ------------------------------------------------------
+  static void clear_dir(const std::string& dir) {
+    mkdir(dir.c_str(), 0755);
+    unlink((dir + "/wal").c_str());
+    unlink((dir + "/snapshot").c_str());
+    unlink((dir + "/snapshot.tmp").c_str());
+  }
+
+public:
+  // a child process writes to dir until it is SIGKILLed after ms
+  // milliseconds, reporting each commit through a pipe; op i is
+  // delete_(i - 2) when i % 4 == 0 and put(i, i) otherwise, with a
+  // checkpoint every 20000 ops. Recovery must then hold every committed op
+  static bool crash_test(const std::string& dir, int group_commit, int ms) {
+    clear_dir(dir);
+    int fds[2];
+    if (pipe(fds) != 0) { fail("pipe"); }
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+      ::close(fds[0]);
+      durable_st<int, int> db(dir, group_commit);
+      for (int i = 1; ; ++i) {
+        long commits = db.stats().commits;
+        if (i % 4 == 0) { db.delete_(i - 2); } else { db.put(i, i); }
+        if (db.stats().commits != commits) {
+          if (::write(fds[1], &i, sizeof i) != (ssize_t)sizeof i) { _exit(1); }
+        }
+        if (i % 20000 == 0) { db.checkpoint(); }
+      }
+    }
+    ::close(fds[1]);
+    usleep(ms * 1000);
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    int acked = 0, i;
+    while (::read(fds[0], &i, sizeof i) == (ssize_t)sizeof i) { acked = i; }
+    ::close(fds[0]);
+
+    durable_st<int, int> db(dir, group_commit);
+    bool ok = true;
+    for (int j = 1; j <= acked && ok; ++j) {
+      bool deleted = j % 4 == 2 && j + 2 <= acked;
+      bool maybe = j % 4 == 2 && j + 2 > acked;       // its delete may have hit the log uncommitted
+      int v = db.get(j);
+      if (j % 4 == 0)    { ok = v == 0; }
+      else if (deleted)  { ok = v == 0; }
+      else if (!maybe)   { ok = v == j; }
+      else               { ok = v == 0 || v == j; }
+    }
+    std::cout << "crash_test: killed after " << ms << " ms, group " << group_commit << ", "
+              << acked << " ops committed, " << db.size() << " keys recovered ("
+              << db.stats().replayed << " log records replayed in " << std::fixed << std::setprecision(2)
+              << db.stats().recovery_seconds * 1000 << " ms): " << (ok ? "ok" : "LOST DATA") << "\n";
+    return ok;
+  }
+
+  // a child process commits 1000 puts, then lowers RLIMIT_FSIZE so that
+  // the next commit is cut off part way through its write() and throws;
+  // with the limit lifted it commits again, and once more after that.
+  // Recovery must then hold all 2100 puts
+  static bool torn_commit_test(const std::string& dir) {
+    clear_dir(dir);
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+      durable_st<int, int> db(dir, 1 << 20);
+      for (int i = 1; i <= 1000; ++i) { db.put(i, i); }
+      db.commit();
+      struct stat sb;
+      struct rlimit lim;
+      if (stat(db.wal_path().c_str(), &sb) != 0 || getrlimit(RLIMIT_FSIZE, &lim) != 0) { _exit(2); }
+      rlim_t max = lim.rlim_cur;
+      signal(SIGXFSZ, SIG_IGN);
+      lim.rlim_cur = (rlim_t)sb.st_size + 100;
+      if (setrlimit(RLIMIT_FSIZE, &lim) != 0) { _exit(2); }
+      for (int i = 1001; i <= 2000; ++i) { db.put(i, i); }
+      bool failed = false;
+      try { db.commit(); } catch (std::runtime_error* e) { failed = true;  delete e; }
+      lim.rlim_cur = max;
+      if (setrlimit(RLIMIT_FSIZE, &lim) != 0) { _exit(2); }
+      db.commit();
+      for (int i = 2001; i <= 2100; ++i) { db.put(i, i); }
+      db.commit();
+      _exit(failed ? 0 : 3);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    durable_st<int, int> db(dir);
+    for (int i = 1; i <= 2100 && ok; ++i) { ok = db.get(i) == i; }
+    std::cout << "torn_commit_test: " << db.size() << " keys recovered ("
+              << db.stats().replayed << " log records replayed): " << (ok ? "ok" : "LOST DATA") << "\n";
+    clear_dir(dir);
+    return ok;
+  }
+
+  // n puts with group commit sizes 1 .. 512: throughput, fsyncs and batch
+  // size, then recovery time by log replay and from a checkpoint
+  static void bench(const std::string& dir, int n) {
+    std::cout << "durable_st bench: " << n << " int puts in '" << dir << "'\n";
+    const int groups[] = { 1, 8, 64, 512 };
+    for (int g : groups) {
+      clear_dir(dir);
+      stopwatch sw;
+      durable_st<int, int>* db = new durable_st<int, int>(dir, g);
+      for (int i = 1; i <= n; ++i) { db->put(i, i); }
+      db->commit();
+      double secs = sw.seconds();
+      metrics m = db->stats();
+      delete db;
+
+      durable_st<int, int> replayed(dir, g);
+      double replay = replayed.stats().recovery_seconds;
+      replayed.checkpoint();
+      durable_st<int, int> loaded(dir, g);
+      if (loaded.size() != n) { throw new std::logic_error("durable_st bench: recovery lost keys"); }
+
+      std::cout << std::fixed << std::setprecision(1)
+                << "  group " << std::setw(3) << g << ": " << std::setw(9) << n / secs << " puts/s, "
+                << std::setw(6) << m.commits << " fsyncs (batch " << std::setw(5) << m.batch() << ", "
+                << std::setw(6) << m.fsync_seconds * 1000 << " ms), " << m.bytes / 1024 << " KiB logged"
+                << std::setprecision(2) << "; recovery: replay " << replay * 1000 << " ms, snapshot "
+                << loaded.stats().recovery_seconds * 1000 << " ms\n";
+    }
+    clear_dir(dir);
+  }
+};
+
+
+#endif /* durable_st_h */
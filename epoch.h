@@ -0,0 +1,102 @@
+//
+//  epoch.h
+//  sqb
+//
+//  Epoch-based reclamation.
+//
+//  A reader brackets each operation with an epoch_domain::guard, which
+//  claims a slot and records the global epoch it started in. Writers retire
+//  objects instead of deleting them; a retired object is freed once every
+//  reader that was active when it was retired has left. retire() and
+//  reclaim() belong to the (single, serialized) writer; guards may be taken
+//  from any number of threads.
+//
+
+#ifndef epoch_h
+#define epoch_h
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+
+#define EPOCH_SLOTS 128
+
+class epoch_domain {
+public:
+  class guard {
+  public:
+    explicit guard(epoch_domain& d) : slot_(d.enter()) { }
+    ~guard() { slot_->store(0, std::memory_order_release); }
+    guard(const guard&) = delete;
+    guard& operator=(const guard&) = delete;
+  private:
+    std::atomic<uint64_t>* slot_;
+  };
+
+  epoch_domain() : epoch_(1) {
+    for (int i = 0; i < EPOCH_SLOTS; ++i) { slots_[i].epoch.store(0); }
+  }
+  epoch_domain(const epoch_domain&) = delete;
+  epoch_domain& operator=(const epoch_domain&) = delete;
+  ~epoch_domain() {
+    for (retired& r : retired_) { r.deleter(r.p); }
+  }
+
+  // p is unreachable for new readers; free it once the old ones are gone
+  void retire(void* p, void (*deleter)(void*)) {
+    retired_.push_back({ p, deleter, epoch_.load() });
+    if (retired_.size() >= 64) { reclaim(); }
+  }
+
+  template <typename T>
+  void retire(T* p) {
+    retire(p, [](void* q) { delete static_cast<T*>(q); });
+  }
+
+  void reclaim() {
+    uint64_t oldest = epoch_.fetch_add(1) + 1;
+    for (int i = 0; i < EPOCH_SLOTS; ++i) {
+      uint64_t e = slots_[i].epoch.load();
+      if (e != 0 && e < oldest) { oldest = e; }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_.size(); ++i) {
+      if (retired_[i].epoch < oldest) { retired_[i].deleter(retired_[i].p); }
+      else                            { retired_[kept++] = retired_[i]; }
+    }
+    retired_.resize(kept);
+  }
+
+  size_t pending() const { return retired_.size(); }
+
+private:
+  struct alignas(64) slot {
+    std::atomic<uint64_t> epoch;      // 0: free, otherwise the epoch its reader entered in
+  };
+  struct retired {
+    void* p;
+    void (*deleter)(void*);
+    uint64_t epoch;
+  };
+
+  // claims a free slot, starting from one picked by thread id so that
+  // concurrent readers usually land on different cache lines
+  std::atomic<uint64_t>* enter() {
+    size_t i = std::hash<std::thread::id>()(std::this_thread::get_id()) % EPOCH_SLOTS;
+    while (true) {
+      uint64_t expected = 0;
+      if (slots_[i].epoch.compare_exchange_strong(expected, epoch_.load())) { return &slots_[i].epoch; }
+      if (++i == EPOCH_SLOTS) { i = 0;  std::this_thread::yield(); }
+    }
+  }
+
+  std::atomic<uint64_t> epoch_;
+  slot slots_[EPOCH_SLOTS];
+  std::vector<retired> retired_;
+};
+
+
+#endif /* epoch_h */
@@ -0,0 +1,146 @@
+//
+//  fixed_key.h
+//  sqb
+//
+//  Fixed-width inline string keys.
+//
+//  fixed_key<N> holds a string of at most N bytes inside the key itself,
+//  zero-padded, as (N + 7) / 8 64-bit words that already hold the bytes
+//  in big-endian order. Integer order of the words is then byte-wise
+//  lexicographic order, so a comparison is one or two word compares
+//  (a single 128-bit compare for N <= 16 where the compiler has one)
+//  with no pointer to chase and no heap block per key. The byte swap is
+//  paid once, when the key is built.
+//
+//  three_way<fixed_key<N>> below is what bst and bst_redblack use by
+//  default, so bst_redblack<fixed_key<16>, V> needs nothing else. Trailing
+//  '\0' bytes are padding, so "ab" and "ab\0" are the same key, and the
+//  empty key is the null key.
+//
+
+#ifndef fixed_key_h
+#define fixed_key_h
+
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "bst.h"
+#include "bst_redblack.h"
+#include "utils.h"
+
+
+template <size_t N> struct fixed_key;
+
+// the default Compare of bst and bst_redblack for fixed_key<N>
+template <size_t N>
+struct three_way<fixed_key<N>> {
+  int operator()(const fixed_key<N>& v, const fixed_key<N>& w) const { return fixed_key<N>::compare(v, w); }
+};
+
+template <size_t N>
+struct fixed_key {
+  static_assert(N > 0, "fixed_key needs room for at least one byte");
+  static const size_t WORDS = (N + 7) / 8;
+
+  uint64_t w[WORDS];
+
+  fixed_key() { for (size_t i = 0; i < WORDS; ++i) { w[i] = 0; } }
+
+  fixed_key(std::string_view s) {
+    if (s.size() > N) { throw new std::length_error("key longer than fixed_key<N>"); }
+    unsigned char b[WORDS * 8] = { 0 };
+    std::memcpy(b, s.data(), s.size());
+    for (size_t i = 0; i < WORDS; ++i) {
+      uint64_t x = 0;
+      for (int j = 0; j < 8; ++j) { x = (x << 8) | b[i * 8 + j]; }
+      w[i] = x;
+    }
+  }
+  fixed_key(const char* s) : fixed_key(std::string_view(s)) { }
+  fixed_key(const std::string& s) : fixed_key(std::string_view(s)) { }
+
+  std::string str() const {
+    char b[WORDS * 8];
+    for (size_t i = 0; i < WORDS; ++i) {
+      for (int j = 0; j < 8; ++j) { b[i * 8 + j] = (char)(w[i] >> (56 - 8 * j)); }
+    }
+    size_t n = WORDS * 8;
+    while (n > 0 && b[n - 1] == '\0') { --n; }
+    return std::string(b, n);
+  }
+
+  static int compare(const fixed_key& a, const fixed_key& b) {
+#if defined(__SIZEOF_INT128__)
+    if constexpr (WORDS == 2) {
+      unsigned __int128 x = ((unsigned __int128)a.w[0] << 64) | a.w[1];
+      unsigned __int128 y = ((unsigned __int128)b.w[0] << 64) | b.w[1];
+      return (x > y) - (x < y);
+    }
+#endif
+    for (size_t i = 0; i + 1 < WORDS; ++i) {
+      if (a.w[i] != b.w[i]) { return a.w[i] < b.w[i] ? -1 : 1; }
+    }
+    return (a.w[WORDS - 1] > b.w[WORDS - 1]) - (a.w[WORDS - 1] < b.w[WORDS - 1]);
+  }
+
+  bool operator==(const fixed_key& o) const {
+    for (size_t i = 0; i < WORDS; ++i) { if (w[i] != o.w[i]) { return false; } }
+    return true;
+  }
+  bool operator!=(const fixed_key& o) const { return !(*this == o); }
+  bool operator<(const fixed_key& o) const { return compare(*this, o) < 0; }
+
+  friend std::ostream& operator<<(std::ostream& os, const fixed_key& k) { return os << k.str(); }
+
+  //-------- benchmark ----------------------------------------------------------------
+  // n random identifiers of 9 .. N bytes: put and random get on bst and
+  // bst_redblack, std::string keys versus fixed_key<N>. Build with NDEBUG:
+  // bst::put() runs its O(n) check() otherwise
+  static void bench(int n) {
+    static_assert(N > 8, "fixed_key::bench() draws identifiers of 9 .. N bytes");
+    std::mt19937 gen(20200311);
+    const char* digits = "0123456789abcdefghijklmnopqrstuvwxyz";
+    std::vector<std::string> ids(n);
+    for (std::string& id : ids) {
+      id = "id_";
+      size_t len = 9 + gen() % (N - 8);
+      while (id.size() < len) { id += digits[gen() % 36]; }
+    }
+    std::vector<fixed_key> fids(ids.begin(), ids.end());
+    std::vector<int> qs(1000000);
+    for (int& q : qs) { q = (int)(gen() % n); }
+
+    std::cout << "fixed_key<" << N << "> bench: " << n << " random identifiers, " << qs.size() << " gets\n";
+    time_tree<bst_redblack<std::string, int>>("bst_redblack<std::string>", ids, qs, bst_redblack<std::string, int>::bytes_per_node());
+    time_tree<bst_redblack<fixed_key, int>>("bst_redblack<fixed_key>", fids, qs, bst_redblack<fixed_key, int>::bytes_per_node());
+    time_tree<bst<std::string, int>>("bst<std::string>", ids, qs, 0);
+    time_tree<bst<fixed_key, int>>("bst<fixed_key>", fids, qs, 0);
+  }
+
+private:
+  template <typename Tree, typename K>
+  static void time_tree(const char* name, std::vector<K>& ks, const std::vector<int>& qs, size_t node_bytes) {
+    Tree st;
+    stopwatch sw;
+    for (size_t i = 0; i < ks.size(); ++i) { st.put(ks[i], (int)i + 1); }
+    double put = sw.seconds();
+    long sum = 0;
+    sw.reset();
+    for (int q : qs) { sum += st.get(ks[q]); }
+    double get = sw.seconds();
+    std::cout << "  " << std::left << std::setw(26) << name << std::right << std::fixed << std::setprecision(1)
+              << " put " << std::setw(6) << put * 1e9 / ks.size() << " ns  get " << std::setw(6)
+              << get * 1e9 / qs.size() << " ns";
+    if (node_bytes != 0) { std::cout << "  node " << node_bytes << " B"; }
+    std::cout << "  (" << sum << ")\n";
+  }
+};
+
+
+#endif /* fixed_key_h */
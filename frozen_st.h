@@ -0,0 +1,201 @@
+//
+//  frozen_st.h
+//  sqb
+//
+//  Read-only ordered symbol table in Eytzinger (BFS) order.
+//
+//  The keys are laid out as an implicit complete binary tree: the root at
+//  index 1 and the children of k at 2k and 2k + 1. A search is a loop of
+//  k = 2k + (key < x) with no branch to mispredict, the top levels share a
+//  handful of cache lines, and the node 4 levels down is prefetched while
+//  the current one is compared. The values sit at the same indices, and
+//  the keys are stored once: the rank of index k and the index of rank r
+//  follow from the shape of the tree in O(1), so rank/select and range
+//  scans need no sorted copy.
+//
+
+#ifndef frozen_st_h
+#define frozen_st_h
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "queue.h"
+#include "utils.h"
+
+
+template <typename Key, typename Value>
+class frozen_st {
+public:
+  frozen_st() : n_(0), h_(0), last_(0) { }
+
+  // [first, last) yields (key, value) pairs in strictly increasing key
+  // order, e.g. a bst_redblack's begin()/end()
+  template <typename It>
+  frozen_st(It first, It last) : n_(0), h_(0), last_(0) {
+    std::vector<Key> ks;
+    std::vector<Value> vs;
+    for (It it = first; it != last; ++it) {
+      ks.push_back((*it).first);
+      vs.push_back((*it).second);
+    }
+    n_ = ks.size();
+    while (((size_t)2 << h_) <= n_) { ++h_; }
+    last_ = n_ - (((size_t)1 << h_) - 1);
+    keys_.resize(n_ + 1);
+    vals_.resize(n_ + 1);
+    for (size_t r = 0; r < n_; ++r) {
+      size_t k = index_of(r);
+      keys_[k] = std::move(ks[r]);
+      vals_[k] = std::move(vs[r]);
+    }
+  }
+
+  int size() const { return (int)n_; }
+  bool is_empty() const { return n_ == 0; }
+
+  Value get(const Key& k) const {
+    size_t i = search<false>(k);
+    return (i != 0 && !(k < keys_[i])) ? vals_[i] : Value();
+  }
+  bool contains(const Key& k) const { return get(k) != Value(); }
+
+  // number of keys < k
+  int rank(const Key& k) const { return (int)lower(k); }
+
+  Key select(int r) const {
+    if (r < 0 || (size_t)r >= n_) { throw new std::invalid_argument("invalid select"); }
+    return key_at(r);
+  }
+
+  Key min() const {
+    if (is_empty()) { throw new std::logic_error("calls min() with empty symbol table"); }
+    return key_at(0);
+  }
+  Key max() const {
+    if (is_empty()) { throw new std::logic_error("calls max() with empty symbol table"); }
+    return key_at((int)n_ - 1);
+  }
+
+  // largest key <= k
+  Key floor(const Key& k) const {
+    size_t r = upper(k);
+    if (r == 0) { throw new std::logic_error("argument to floor() is too small"); }
+    return key_at((int)r - 1);
+  }
+
+  // smallest key >= k
+  Key ceiling(const Key& k) const {
+    size_t i = search<false>(k);
+    if (i == 0) { throw new std::logic_error("argument to ceiling() is too large"); }
+    return keys_[i];
+  }
+
+  // ranks [first, second) of the keys in [low, high]; walk them with
+  // key_at()/value_at() for a range scan that copies nothing
+  std::pair<int, int> range(const Key& low, const Key& high) const {
+    if (high < low) { return std::make_pair(0, 0); }
+    return std::make_pair((int)lower(low), (int)upper(high));
+  }
+  const Key& key_at(int r) const { return keys_[index_of(r)]; }
+  const Value& value_at(int r) const { return vals_[index_of(r)]; }
+
+  array_queue<Key> keys(const Key& low, const Key& high) const {
+    array_queue<Key> q;
+    std::pair<int, int> r = range(low, high);
+    for (int i = r.first; i < r.second; ++i) { q.enqueue(key_at(i)); }
+    return q;
+  }
+
+  size_t bytes() const {
+    return keys_.capacity() * sizeof(Key) + vals_.capacity() * sizeof(Value);
+  }
+
+private:
+  // The tree has levels 0 .. h_; the levels above h_ are full and level
+  // h_ holds last_ nodes, packed to the left. In key order the nodes of
+  // the last level and of the full levels alternate until the last level
+  // runs out, so node p of the last level has rank 2p, and a node of rank
+  // f among the full levels alone has rank f + min(last_, f + 1).
+
+  // rank of the node at index k
+  size_t rank_of(size_t k) const {
+    int d = floor_log2(k);
+    size_t p = k - ((size_t)1 << d);
+    if (d == h_) { return 2 * p; }
+    size_t f1 = (2 * p + 1) << (h_ - 1 - d);    // f + 1
+    return f1 - 1 + std::min(last_, f1);
+  }
+
+  // index of the node of rank r
+  size_t index_of(size_t r) const {
+    if (r < 2 * last_ && r % 2 == 0) { return ((size_t)1 << h_) + r / 2; }
+    size_t f1 = (r < 2 * last_ ? (r - 1) / 2 : r - last_) + 1;
+    int s = trailing_zeros(f1);
+    return ((size_t)1 << (h_ - 1 - s)) + (f1 >> (s + 1));
+  }
+
+  // index of the first key >= x (Strict: > x), 0 if there is none
+  template <bool Strict>
+  size_t search(const Key& x) const {
+    const size_t ahead = 16;                  // 4 levels down
+    size_t k = 1;
+    while (k <= n_) {
+      if (k * ahead <= n_) { prefetch(&keys_[k * ahead]); }
+      k = 2 * k + (Strict ? !(x < keys_[k]) : keys_[k] < x);
+    }
+    // undo the right turns taken after the last left turn; that left turn
+    // was at the answer
+    return k >> (trailing_ones(k) + 1);
+  }
+  size_t lower(const Key& x) const {
+    size_t k = search<false>(x);
+    return k == 0 ? n_ : rank_of(k);
+  }
+  size_t upper(const Key& x) const {
+    size_t k = search<true>(x);
+    return k == 0 ? n_ : rank_of(k);
+  }
+
+  static int trailing_ones(size_t k) { return trailing_zeros(~k); }
+
+  static int trailing_zeros(size_t k) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll((unsigned long long)k);
+#else
+    int t = 0;
+    while (!(k & 1)) { k >>= 1;  ++t; }
+    return t;
+#endif
+  }
+
+  static int floor_log2(size_t k) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll((unsigned long long)k);
+#else
+    int d = 0;
+    while (k >>= 1) { ++d; }
+    return d;
+#endif
+  }
+
+  static void prefetch(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+  }
+
+  size_t n_;
+  int h_;                        // depth of the last level
+  size_t last_;                  // nodes on the last level
+  std::vector<Key> keys_;        // keys_[1..n], Eytzinger order
+  std::vector<Value> vals_;      // vals_[k] goes with keys_[k]
+};
+
+
+#endif /* frozen_st_h */
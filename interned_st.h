@@ -0,0 +1,242 @@
+//
+//  interned_st.h
+//  sqb
+//
+//  std::string-keyed symbol table with interned, prefix-compressed keys.
+//
+//  A bst_redblack<std::string, Value> node carries a 32-byte std::string,
+//  and every key longer than the small-string buffer is a separate heap
+//  block that each comparison has to chase. Here the characters of every
+//  key are appended once to a string_pool shared by the table (and by the
+//  pieces a split() leaves), and the node stores a 16-byte interned_key:
+//  the first 8 bytes of the key packed big-endian into an integer, the
+//  pool offset and the length. Two keys whose first 8 bytes differ are
+//  ordered by one integer compare on data already in the node; only keys
+//  that share those 8 bytes look at the pool, and then only past them.
+//
+//  The pool only grows: deleting a key leaves its characters behind, so
+//  this suits tables that are mostly built and read, like vocabularies.
+//
+
+#ifndef interned_st_h
+#define interned_st_h
+
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "bst_redblack.h"
+#include "node_arena.h"
+#include "utils.h"
+
+
+//---------------------------------------------------------
+// the first 8 bytes of s as a big-endian integer, zero-padded, so
+// integer order is byte-wise lexicographic order
+inline uint64_t key_prefix(std::string_view s) {
+  unsigned char b[8] = { 0 };
+  std::memcpy(b, s.data(), s.size() < 8 ? s.size() : 8);
+  uint64_t p = 0;
+  for (int i = 0; i < 8; ++i) { p = (p << 8) | b[i]; }
+  return p;
+}
+
+class string_pool;
+
+// a key stored in a string_pool; the default (empty) key is the null key.
+// == is identity, which is all the tree needs it for
+struct interned_key {
+  uint64_t prefix;
+  uint32_t offset;
+  uint32_t length;
+
+  interned_key() : prefix(0), offset(0), length(0) { }
+  interned_key(uint64_t prefix_, uint32_t offset_, uint32_t length_)
+  : prefix(prefix_), offset(offset_), length(length_) { }
+  template <typename Probe, typename = decltype(&Probe::intern)>
+  explicit interned_key(const Probe& p) : interned_key(p.intern()) { }
+
+  bool operator==(const interned_key& o) const {
+    return prefix == o.prefix && offset == o.offset && length == o.length;
+  }
+  bool operator!=(const interned_key& o) const { return !(*this == o); }
+};
+
+class string_pool {
+public:
+  interned_key intern(std::string_view s) {
+    if (chars_.size() + s.size() > UINT32_MAX) { throw new std::length_error("string_pool is full"); }
+    uint32_t at = (uint32_t)chars_.size();
+    chars_.insert(chars_.end(), s.begin(), s.end());
+    return interned_key(key_prefix(s), at, (uint32_t)s.size());
+  }
+
+  std::string_view view(const interned_key& k) const {
+    return std::string_view(chars_.data() + k.offset, k.length);
+  }
+
+  size_t bytes() const { return chars_.capacity(); }
+
+private:
+  std::vector<char> chars_;        // grows by reallocation: keys hold offsets, not pointers
+};
+
+// a lookup key with its prefix computed once per search rather than once
+// per node; a tree that inserts it builds the interned_key from it, so the
+// pool only grows when a key is actually added
+struct interned_probe {
+  uint64_t prefix;
+  std::string_view s;
+  string_pool* pool;
+
+  interned_probe(std::string_view s_, string_pool* pool_) : prefix(key_prefix(s_)), s(s_), pool(pool_) { }
+  interned_key intern() const { return pool->intern(s); }
+};
+
+inline bool operator==(const interned_probe& p, const interned_key& k) { return p.s.empty() && k.length == 0; }
+
+
+//---------------------------------------------------------
+// three-way order of interned keys; stateful, it reads the pool only when
+// two prefixes are equal
+struct interned_compare {
+  typedef void is_transparent;
+  const string_pool* pool;
+
+  explicit interned_compare(const string_pool* pool_ = nullptr) : pool(pool_) { }
+
+  int operator()(const interned_key& a, const interned_key& b) const {
+    if (a.prefix != b.prefix) { return a.prefix < b.prefix ? -1 : 1; }
+    return tail(pool->view(a), pool->view(b));
+  }
+  int operator()(const interned_probe& a, const interned_key& b) const {
+    if (a.prefix != b.prefix) { return a.prefix < b.prefix ? -1 : 1; }
+    return tail(a.s, pool->view(b));
+  }
+  int operator()(const interned_key& a, const interned_probe& b) const { return -(*this)(b, a); }
+
+private:
+  // a and b share their first 8 bytes (or all of the shorter one)
+  static int tail(std::string_view a, std::string_view b) {
+    size_t n = std::min(a.size(), b.size());
+    if (n > 8) {
+      int c = std::memcmp(a.data() + 8, b.data() + 8, n - 8);
+      if (c != 0) { return c; }
+    }
+    return a.size() < b.size() ? -1 : (a.size() > b.size() ? 1 : 0);
+  }
+};
+
+
+//---------------------------------------------------------
+template <typename Value, template <typename> class Alloc = node_arena>
+class interned_st {
+public:
+  typedef bst_redblack<interned_key, Value, Alloc, interned_compare> tree;
+
+  interned_st() : pool_(std::make_shared<string_pool>()), st_(interned_compare(pool_.get())) { }
+
+  int size() { return st_.size(); }
+  bool is_empty() { return st_.is_empty(); }
+
+  Value get(std::string_view k) { return st_.get(probe(k)); }
+  bool contains(std::string_view k) { return st_.contains(probe(k)); }
+
+  // one pass; the key is interned only if it is new
+  void put(std::string_view k, const Value& v) {
+    if (v == Value()) { st_.delete_(probe(k));  return; }
+    st_.upsert(probe(k), [&](Value& x) { x = v; });
+  }
+
+  template <typename F>
+  bool upsert(std::string_view k, F fn) { return st_.upsert(probe(k), fn); }
+
+  bool delete_(std::string_view k) { return st_.delete_(probe(k)); }
+
+  std::string_view key(const interned_key& k) const { return pool_->view(k); }
+
+  // in key order; it.key() is an interned_key, key(it.key()) its text
+  typename tree::iterator begin() { return st_.begin(); }
+  typename tree::iterator end() { return st_.end(); }
+
+  // nodes plus pooled characters
+  size_t bytes() { return (size_t)size() * tree::bytes_per_node() + pool_->bytes(); }
+
+private:
+  interned_probe probe(std::string_view k) const { return interned_probe(k, pool_.get()); }
+
+  std::shared_ptr<string_pool> pool_;
+  tree st_;
+
+  //-------- benchmark ----------------------------------------------------------------
+public:
+  // word counts over the vocabulary of filename: bytes per key and random
+  // lookup latency, bst_redblack<std::string, int> versus interned_st<int>
+  static void bench(const std::string& filename) {
+    char buf[BUFSIZ];
+    std::ifstream ifs(filename);
+    if (!ifs.is_open()) {
+      std::cerr << "Could not open file: '" << filename << "'\n";  exit(2);
+    }
+    std::vector<std::string> tokens;
+    std::string s;
+    while (ifs >> s) {
+      strncpy(buf, s.c_str(), BUFSIZ - 1);
+      buf[BUFSIZ - 1] = '\0';
+      strconvert(buf, tolower);
+      strstrip(buf);
+      if (buf[0] != '\0') { tokens.push_back(buf); }
+    }
+
+    bst_redblack<std::string, int> plain;
+    interned_st<int> interned;
+    for (const std::string& w : tokens) {
+      plain.upsert(w, [](int& n) { ++n; });
+      interned.upsert(w, [](int& n) { ++n; });
+    }
+    std::vector<std::string> vocab;
+    size_t chars = 0, heap = 0;
+    for (auto it = plain.begin(); it != plain.end(); ++it) {
+      const std::string& w = it.key();
+      vocab.push_back(w);
+      chars += w.size();
+      // characters past the small-string buffer live in their own block
+      if (w.capacity() > std::string().capacity()) { heap += w.capacity() + 1; }
+      if (interned.get(w) != it.value()) { throw new std::logic_error("interned_st bench: counts differ"); }
+    }
+    size_t n = vocab.size();
+    size_t plain_bytes = n * bst_redblack<std::string, int>::bytes_per_node() + heap;
+
+    std::vector<std::string> qs(1000000);
+    std::mt19937 gen(20200311);
+    for (std::string& q : qs) { q = vocab[gen() % n]; }
+    long sum[2] = { 0, 0 };
+    stopwatch sw;
+    for (const std::string& q : qs) { sum[0] += plain.get(q); }
+    double t0 = sw.seconds();
+    sw.reset();
+    for (const std::string& q : qs) { sum[1] += interned.get(q); }
+    double t1 = sw.seconds();
+    if (sum[0] != sum[1]) { throw new std::logic_error("interned_st bench: lookups differ"); }
+
+    std::cout << "interned_st bench: '" << filename << "', " << tokens.size() << " tokens, " << n
+              << " distinct keys, " << std::fixed << std::setprecision(1) << (double)chars / n << " chars/key\n"
+              << "  bst_redblack<std::string>: " << std::setw(5) << (double)plain_bytes / n << " bytes/key"
+              << " (node " << bst_redblack<std::string, int>::bytes_per_node() << " + "
+              << (double)heap / n << " heap), " << std::setw(6) << t0 * 1e9 / qs.size() << " ns/get\n"
+              << "  interned_st:               " << std::setw(5) << (double)interned.bytes() / n << " bytes/key"
+              << " (node " << tree::bytes_per_node() << " + " << (double)interned.pool_->bytes() / n
+              << " pool), " << std::setw(6) << t1 * 1e9 / qs.size() << " ns/get\n"
+              << "  (allocator headers not counted: one per heap block on the std::string side)\n";
+  }
+};
+
+
+#endif /* interned_st_h */
@@ -0,0 +1,157 @@
+//
+//  multiset_st.h
+//  sqb
+//
+//  Ordered multiset: one bst_redblack node per distinct key, carrying the
+//  key's multiplicity as its value.
+//
+//  The tree keeps the sum of the multiplicities of every subtree as its
+//  aggregate (sum_aggregate), so size(), rank() and select() count copies,
+//  not nodes, in O(log n). put(), remove_one() and remove_all() change a
+//  count with one upsert(), a single descent; when the last copy goes,
+//  upsert() unlinks the node from the path it just searched. A stream of
+//  t tokens over d distinct keys costs d nodes, however often each key
+//  repeats.
+//
+
+#ifndef multiset_st_h
+#define multiset_st_h
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "aggregate.h"
+#include "bst_redblack.h"
+#include "node_arena.h"
+#include "utils.h"
+
+
+template <typename Key, template <typename> class Alloc = node_arena, typename Compare = three_way<Key>>
+class multiset_st {
+public:
+  typedef bst_redblack<Key, long, Alloc, Compare, sum_aggregate<long>> tree;
+
+  explicit multiset_st(const Compare& comp = Compare()) : st_(comp) { }
+
+  // copies of all keys
+  long size() { return st_.aggregate(); }
+  int distinct() { return st_.size(); }
+  bool is_empty() { return st_.is_empty(); }
+
+  long count(const Key& k) { return st_.get(k); }
+  bool contains(const Key& k) { return st_.contains(k); }
+
+  // adds n copies of k
+  void put(const Key& k, long n = 1) {
+    if (n < 0) { throw new std::invalid_argument("put() with a negative count"); }
+    st_.upsert(k, [n](long& c) { c += n; });
+  }
+
+  // removes one copy of k; returns false if there was none
+  bool remove_one(const Key& k) {
+    bool removed = false;
+    st_.upsert(k, [&](long& c) { if (c > 0) { --c;  removed = true; } });
+    return removed;
+  }
+
+  // removes every copy of k; returns how many there were
+  long remove_all(const Key& k) {
+    long n = 0;
+    st_.upsert(k, [&](long& c) { n = c;  c = 0; });
+    return n;
+  }
+
+  // copies of keys < k
+  long rank(const Key& k) { return st_.aggregate_below(k); }
+
+  // the key of the copy at rank r, 0 <= r < size()
+  Key select(long r) { return st_.select_aggregate(r); }
+
+  // copies of keys in [low, high]
+  long size(const Key& low, const Key& high) { return st_.aggregate(low, high); }
+
+  Key min() { return st_.min(); }
+  Key max() { return st_.max(); }
+
+  // distinct keys in order; it.value() is the multiplicity
+  typename tree::iterator begin() { return st_.begin(); }
+  typename tree::iterator end() { return st_.end(); }
+
+  size_t bytes() { return (size_t)distinct() * tree::bytes_per_node(); }
+
+private:
+  tree st_;
+
+  //-------- benchmark ----------------------------------------------------------------
+public:
+  // the tokens of filename, read passes times, counted by a
+  // multiset_st<std::string> versus read-modify-write put()s on a
+  // bst_redblack<std::string, int>; rank/select are checked against the
+  // sorted token stream
+  static void bench(const std::string& filename, int passes) {
+    char buf[BUFSIZ];
+    std::ifstream ifs(filename);
+    if (!ifs.is_open()) {
+      std::cerr << "Could not open file: '" << filename << "'\n";  exit(2);
+    }
+    std::vector<std::string> words;
+    std::string s;
+    while (ifs >> s) {
+      strncpy(buf, s.c_str(), BUFSIZ - 1);
+      buf[BUFSIZ - 1] = '\0';
+      strconvert(buf, tolower);
+      strstrip(buf);
+      if (buf[0] != '\0') { words.push_back(buf); }
+    }
+
+    multiset_st<std::string> ms;
+    bst_redblack<std::string, int> freq;
+    stopwatch sw;
+    for (int p = 0; p < passes; ++p) {
+      for (const std::string& w : words) { ms.put(w); }
+    }
+    double t_ms = sw.seconds();
+    sw.reset();
+    for (int p = 0; p < passes; ++p) {
+      for (const std::string& w : words) {
+        int n = freq.contains(w) ? freq.get(w) : 0;
+        freq.put(w, n + 1);
+      }
+    }
+    double t_rmw = sw.seconds();
+
+    std::vector<std::string> sorted(words);
+    std::sort(sorted.begin(), sorted.end());
+    long total = (long)words.size() * passes;
+    if (ms.size() != total) { throw new std::logic_error("multiset_st bench: size differs"); }
+    for (size_t i = 0; i < sorted.size(); i += 7) {
+      long r = (long)i * passes;
+      if (ms.select(r) != sorted[i] || ms.rank(sorted[i]) != (long)(std::lower_bound(sorted.begin(), sorted.end(), sorted[i]) - sorted.begin()) * passes) {
+        throw new std::logic_error("multiset_st bench: rank/select disagree with the sorted stream");
+      }
+    }
+    for (auto it = freq.begin(); it != freq.end(); ++it) {
+      if (ms.count(it.key()) != it.value()) { throw new std::logic_error("multiset_st bench: counts differ"); }
+    }
+    long removed = 0;
+    sw.reset();
+    for (const std::string& w : words) { removed += ms.remove_one(w); }
+    double t_rm = sw.seconds();
+    if (ms.size() != total - removed) { throw new std::logic_error("multiset_st bench: remove_one miscounted"); }
+
+    double t = (double)total;
+    std::cout << "multiset_st bench: '" << filename << "' x" << passes << ", " << total << " tokens, "
+              << ms.distinct() << " nodes (" << ms.bytes() / 1024 << " KiB)\n" << std::fixed << std::setprecision(1)
+              << "  multiset_st::put              " << std::setw(6) << t_ms * 1e9 / t << " ns/token\n"
+              << "  contains + get + put          " << std::setw(6) << t_rmw * 1e9 / t << " ns/token\n"
+              << "  multiset_st::remove_one       " << std::setw(6) << t_rm * 1e9 / words.size() << " ns/token\n";
+  }
+};
+
+
+#endif /* multiset_st_h */
@@ -0,0 +1,147 @@
+//
+//  node_arena.h
+//  sqb
+//
+//  Allocation policies for tree nodes.
+//
+//  node_arena carves nodes out of large chunks, recycles freed nodes through
+//  an intrusive free list and gives every chunk back in one step when it is
+//  released, so tearing down a tree costs O(chunks) instead of O(nodes).
+//  heap_node_alloc is the plain new/delete policy, kept for comparison.
+//
+
+#ifndef node_arena_h
+#define node_arena_h
+
+#include <cstddef>
+#include <new>
+
+
+#define ARENA_CHUNK_NODES 4096
+
+//---------------------------------------------------------
+template <typename T>
+class node_arena {
+public:
+  static const bool bulk_release = true;
+
+  node_arena() : node_arena(ARENA_CHUNK_NODES) { }
+  explicit node_arena(size_t chunk_nodes)
+  : chunks_(nullptr), free_(nullptr), next_(nullptr), end_(nullptr),
+    chunk_nodes_(chunk_nodes == 0 ? 1 : chunk_nodes), chunk_count_(0) { }
+  node_arena(node_arena&& other) : node_arena(other.chunk_nodes_) { steal(other); }
+  node_arena& operator=(node_arena&& other) {
+    if (this != &other) { release();  steal(other); }
+    return *this;
+  }
+  node_arena(const node_arena&) = delete;
+  node_arena& operator=(const node_arena&) = delete;
+  ~node_arena() { release(); }
+
+  // raw, uninitialized storage for one T
+  T* allocate() {
+    if (free_ != nullptr) {
+      slot* s = free_;
+      free_ = s->next;
+      return reinterpret_cast<T*>(s);
+    }
+    if (next_ == end_) { grow(); }
+    return reinterpret_cast<T*>(next_++);
+  }
+
+  // p must already be destroyed; its storage goes back on the free list
+  void deallocate(T* p) {
+    slot* s = reinterpret_cast<slot*>(p);
+    s->next = free_;
+    free_ = s;
+  }
+
+  // take over other's chunks, e.g. when two trees are joined into one
+  void merge(node_arena& other) {
+    if (this == &other) { return; }
+    while (other.next_ != other.end_) { deallocate(reinterpret_cast<T*>(other.next_++)); }
+    while (other.free_ != nullptr) {
+      slot* s = other.free_;
+      other.free_ = s->next;
+      deallocate(reinterpret_cast<T*>(s));
+    }
+    if (other.chunks_ != nullptr) {
+      chunk* last = other.chunks_;
+      while (last->next != nullptr) { last = last->next; }
+      last->next = chunks_;
+      chunks_ = other.chunks_;
+    }
+    chunk_count_ += other.chunk_count_;
+    other.chunks_ = nullptr;
+    other.next_ = other.end_ = nullptr;
+    other.chunk_count_ = 0;
+  }
+
+  // frees every chunk; does NOT run destructors of live nodes
+  void release() {
+    while (chunks_ != nullptr) {
+      chunk* c = chunks_;
+      chunks_ = c->next;
+      ::operator delete(c);
+    }
+    free_ = next_ = end_ = nullptr;
+    chunk_count_ = 0;
+  }
+
+  size_t chunks() const { return chunk_count_; }
+  size_t bytes_reserved() const { return chunk_count_ * chunk_bytes(); }
+
+private:
+  union slot {
+    slot* next;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+  struct chunk {
+    chunk* next;
+  };
+
+  static size_t header_bytes() {
+    return (sizeof(chunk) + alignof(slot) - 1) / alignof(slot) * alignof(slot);
+  }
+  size_t chunk_bytes() const { return header_bytes() + chunk_nodes_ * sizeof(slot); }
+
+  void grow() {
+    chunk* c = static_cast<chunk*>(::operator new(chunk_bytes()));
+    c->next = chunks_;
+    chunks_ = c;
+    ++chunk_count_;
+    next_ = reinterpret_cast<slot*>(reinterpret_cast<char*>(c) + header_bytes());
+    end_ = next_ + chunk_nodes_;
+  }
+
+  void steal(node_arena& other) {
+    chunks_ = other.chunks_;            free_ = other.free_;
+    next_ = other.next_;                end_ = other.end_;
+    chunk_nodes_ = other.chunk_nodes_;  chunk_count_ = other.chunk_count_;
+    other.chunks_ = nullptr;  other.free_ = other.next_ = other.end_ = nullptr;
+    other.chunk_count_ = 0;
+  }
+
+  chunk* chunks_;
+  slot* free_;
+  slot* next_;
+  slot* end_;
+  size_t chunk_nodes_;
+  size_t chunk_count_;
+};
+
+
+//---------------------------------------------------------
+template <typename T>
+class heap_node_alloc {
+public:
+  static const bool bulk_release = false;
+
+  T* allocate() { return static_cast<T*>(::operator new(sizeof(T))); }
+  void deallocate(T* p) { ::operator delete(p); }
+  void merge(heap_node_alloc&) { }
+  void release() { }
+};
+
+
+#endif /* node_arena_h */
@@ -13,10 +13,15 @@
 #include "utils.h"
 
 
-template <typename T>
+// Compare is a less-than callable; any comparator passed to sort() is
+// taken by its own type, so a concrete one is inlined into the inner loop
+template <typename T, typename Compare = fwd_comparator<T>>
 class selection_sort {          
 public:
-  static void sort(T* arr, size_t n, const comparator<T>& comp=fwd_comparator<T>()) {
+  static void sort(T* arr, size_t n) { sort(arr, n, Compare()); }
+
+  template <typename C>
+  static void sort(T* arr, size_t n, const C& comp) {
     for (size_t i = 0; i < n; ++i) {
       size_t min = i;
       for (size_t j = i + 1; j < n; ++j) {
@@ -0,0 +1,300 @@
+//
+//  sharded_st.h
+//  sqb
+//
+//  Range-partitioned symbol table.
+//
+//  The key space is cut into K ranges by K - 1 boundary keys; each range is
+//  an independent bst_redblack with its own mutex, so writers to different
+//  ranges never wait for each other. The router (the boundaries) is behind
+//  a shared_mutex: every operation holds it shared, and only rebalance()
+//  takes it exclusively. Ordered queries lock the shards they need in
+//  ascending order and combine the per-shard answers.
+//
+//  When one shard grows well past the average the writer that notices
+//  rebalances: all shards are joined into one tree and split again at the
+//  K-quantile keys, which costs O(K log n) and moves no nodes. A fresh
+//  table has no boundaries and routes every key to shard 0, so the first
+//  rebalance runs as soon as 2K keys have arrived rather than at the
+//  first skew check; a caller who knows the key distribution can pass the
+//  boundaries to the constructor instead.
+//
+
+#ifndef sharded_st_h
+#define sharded_st_h
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "bst_redblack.h"
+#include "utils.h"
+
+
+#define SHARDED_DEFAULT_SHARDS 16
+#define SHARDED_CHECK_INTERVAL 4096     // writes between skew checks
+
+template <typename Key, typename Value>
+class sharded_st {
+public:
+  // shards are written from different threads, so they cannot share an
+  // arena the way split() pieces otherwise would
+  typedef bst_redblack<Key, Value, heap_node_alloc> tree;
+
+  explicit sharded_st(int shards = SHARDED_DEFAULT_SHARDS) : writes_(0), routed_(false) {
+    if (shards < 1) { throw new std::invalid_argument("sharded_st needs at least one shard"); }
+    for (int i = 0; i < shards; ++i) { shards_.emplace_back(new shard()); }
+  }
+
+  // bounds.size() + 1 shards, split at the given strictly increasing keys;
+  // later rebalances still move them to the quantiles of the actual keys
+  explicit sharded_st(const std::vector<Key>& bounds) : bounds_(bounds), writes_(0), routed_(!bounds.empty()) {
+    for (size_t i = 1; i < bounds_.size(); ++i) {
+      if (!(bounds_[i - 1] < bounds_[i])) { throw new std::invalid_argument("sharded_st boundaries must increase"); }
+    }
+    for (size_t i = 0; i <= bounds_.size(); ++i) { shards_.emplace_back(new shard()); }
+  }
+  sharded_st(const sharded_st&) = delete;
+  sharded_st& operator=(const sharded_st&) = delete;
+
+  int shards() const { return (int)shards_.size(); }
+  int shard_size(int i) const { return shards_[i]->count.load(std::memory_order_relaxed); }
+
+  //-------- single-key operations -----------------------------------------------------
+  void put(const Key& k, const Value& v) {
+    {
+      std::shared_lock<std::shared_mutex> route(router_);
+      shard& s = *shards_[route_of(k)];
+      std::lock_guard<std::mutex> lock(s.lock);
+      s.st.put(k, v);
+      s.count.store(s.st.size(), std::memory_order_relaxed);
+    }
+    wrote();
+  }
+
+  void delete_(const Key& k) {
+    {
+      std::shared_lock<std::shared_mutex> route(router_);
+      shard& s = *shards_[route_of(k)];
+      std::lock_guard<std::mutex> lock(s.lock);
+      s.st.delete_(k);
+      s.count.store(s.st.size(), std::memory_order_relaxed);
+    }
+    wrote();
+  }
+
+  Value get(const Key& k) {
+    std::shared_lock<std::shared_mutex> route(router_);
+    shard& s = *shards_[route_of(k)];
+    std::lock_guard<std::mutex> lock(s.lock);
+    return s.st.get(k);
+  }
+
+  bool contains(const Key& k) { return get(k) != Value(); }
+
+  //-------- ordered operations across shards --------------------------------------------
+  int size() {
+    std::shared_lock<std::shared_mutex> route(router_);
+    std::vector<std::unique_lock<std::mutex>> locks = lock_all();
+    int n = 0;
+    for (auto& s : shards_) { n += s->st.size(); }
+    return n;
+  }
+
+  bool is_empty() { return size() == 0; }
+
+  Key min() {
+    std::shared_lock<std::shared_mutex> route(router_);
+    std::vector<std::unique_lock<std::mutex>> locks = lock_all();
+    for (auto& s : shards_) {
+      if (!s->st.is_empty()) { return s->st.min(); }
+    }
+    throw new std::logic_error("calls min() with empty symbol table");
+  }
+
+  Key max() {
+    std::shared_lock<std::shared_mutex> route(router_);
+    std::vector<std::unique_lock<std::mutex>> locks = lock_all();
+    for (size_t i = shards_.size(); i-- > 0; ) {
+      if (!shards_[i]->st.is_empty()) { return shards_[i]->st.max(); }
+    }
+    throw new std::logic_error("calls max() with empty symbol table");
+  }
+
+  // number of keys < k
+  int rank(const Key& k) {
+    std::shared_lock<std::shared_mutex> route(router_);
+    size_t home = route_of(k);
+    std::vector<std::unique_lock<std::mutex>> locks = lock_all(home + 1);
+    int r = 0;
+    for (size_t i = 0; i < home; ++i) { r += shards_[i]->st.size(); }
+    return r + shards_[home]->st.rank(k);
+  }
+
+  Key select(int r) {
+    std::shared_lock<std::shared_mutex> route(router_);
+    std::vector<std::unique_lock<std::mutex>> locks = lock_all();
+    if (r >= 0) {
+      for (auto& s : shards_) {
+        int n = s->st.size();
+        if (r < n) { return s->st.select(r); }
+        r -= n;
+      }
+    }
+    throw new std::invalid_argument("invalid select");
+  }
+
+  array_queue<Key> keys(const Key& low, const Key& high) {
+    array_queue<Key> q;
+    if (high < low) { return q; }
+    std::shared_lock<std::shared_mutex> route(router_);
+    size_t first = route_of(low), last = route_of(high);
+    std::vector<std::unique_lock<std::mutex>> locks = lock_all(last + 1, first);
+    for (size_t i = first; i <= last; ++i) {
+      if (shards_[i]->st.is_empty()) { continue; }
+      array_queue<Key> part = shards_[i]->st.keys(low, high);
+      while (!part.empty()) { q.enqueue(part.dequeue()); }
+    }
+    return q;
+  }
+
+  //-------- rebalancing --------------------------------------------------------------
+  // moves the boundaries to the K-quantiles of the current keys
+  void rebalance() {
+    std::unique_lock<std::shared_mutex> route(router_);
+    rebalance_locked();
+  }
+
+  int rebalances() const { return rebalances_; }
+
+private:
+  // rebalance() with router_ held exclusively
+  void rebalance_locked() {
+    size_t k = shards_.size();
+    tree all = std::move(shards_[0]->st);
+    for (size_t i = 1; i < k; ++i) { all = tree::join(std::move(all), std::move(shards_[i]->st)); }
+
+    int n = all.size();
+    if ((size_t)n >= k) {
+      bounds_.clear();
+      for (size_t i = 1; i < k; ++i) { bounds_.push_back(all.select((int)(i * (size_t)n / k))); }
+    }
+    for (size_t i = k; i-- > 1; ) {
+      if (i > bounds_.size()) { continue; }       // no boundaries yet: everything stays in shard 0
+      std::pair<tree, tree> halves = all.split(bounds_[i - 1]);
+      shards_[i]->st = std::move(halves.second);
+      all = std::move(halves.first);
+    }
+    shards_[0]->st = std::move(all);
+    for (auto& s : shards_) { s->count.store(s->st.size(), std::memory_order_relaxed); }
+    routed_.store(!bounds_.empty(), std::memory_order_relaxed);
+    ++rebalances_;
+  }
+
+  // places the first boundaries, unless a racing writer already has
+  void route_first() {
+    std::unique_lock<std::shared_mutex> route(router_);
+    if (bounds_.empty()) { rebalance_locked(); }
+  }
+
+  struct shard {
+    shard() : count(0) { }
+    std::mutex lock;
+    tree st;
+    std::atomic<int> count;          // st.size(), readable without the lock
+  };
+
+  // shard i holds [bounds_[i - 1], bounds_[i]); bounds_ is empty until the
+  // first rebalance, so until then everything goes to shard 0
+  size_t route_of(const Key& k) const {
+    return std::upper_bound(bounds_.begin(), bounds_.end(), k) - bounds_.begin();
+  }
+
+  // locks shards [first, end) in ascending order, the one order every
+  // multi-shard operation uses
+  std::vector<std::unique_lock<std::mutex>> lock_all(size_t end = (size_t)-1, size_t first = 0) {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    end = std::min(end, shards_.size());
+    for (size_t i = first; i < end; ++i) { locks.emplace_back(shards_[i]->lock); }
+    return locks;
+  }
+
+  // once shard 0 of a table with no boundaries holds 2K keys, place them;
+  // after that, every SHARDED_CHECK_INTERVAL writes, rebalance if the
+  // largest shard holds more than twice its share
+  void wrote() {
+    long w = writes_.fetch_add(1, std::memory_order_relaxed);
+    long k = (long)shards_.size();
+    if (!routed_.load(std::memory_order_relaxed)) {
+      if (k > 1 && shards_[0]->count.load(std::memory_order_relaxed) >= 2 * k) { route_first(); }
+      return;
+    }
+    if (w % SHARDED_CHECK_INTERVAL != 0) { return; }
+    long total = 0, largest = 0;
+    for (auto& s : shards_) {
+      long n = s->count.load(std::memory_order_relaxed);
+      total += n;
+      largest = std::max(largest, n);
+    }
+    if (k > 1 && total >= 2 * k && largest * k > 2 * total) { rebalance(); }
+  }
+
+  std::vector<std::unique_ptr<shard>> shards_;
+  std::vector<Key> bounds_;
+  mutable std::shared_mutex router_;
+  std::atomic<long> writes_;
+  std::atomic<bool> routed_;       // bounds_ is not empty
+  std::atomic<int> rebalances_{0};
+
+  //-------- benchmark ----------------------------------------------------------------
+public:
+  // insert throughput of 1, 2, 4, ... threads writing disjoint shuffled
+  // keys, against one mutex around a single bst_redblack
+  static void bench_inserts(int n) {
+    std::cout << "sharded_st bench_inserts: " << n << " shuffled int keys\n";
+    std::vector<int> ks(n);
+    for (int i = 0; i < n; ++i) { ks[i] = i + 1; }
+    std::shuffle(ks.begin(), ks.end(), std::mt19937(42));
+
+    int hw = (int)std::max(1u, std::thread::hardware_concurrency());
+    for (int t = 1; t <= hw; t *= 2) {
+      double locked, sharded;
+      {
+        bst_redblack<int, int> st;
+        std::mutex lock;
+        locked = run(t, ks, [&](int k) { std::lock_guard<std::mutex> g(lock);  st.put(k, k); });
+      }
+      {
+        sharded_st<int, int> st;
+        sharded = run(t, ks, [&](int k) { st.put(k, k); });
+        if (st.size() != n) { throw new std::logic_error("bench_inserts: lost keys"); }
+      }
+      std::cout << "  threads " << std::setw(3) << t
+                << "  mutex+bst_redblack puts/s " << std::setw(10) << (long)(n / locked)
+                << "  sharded_st puts/s " << std::setw(10) << (long)(n / sharded) << "\n";
+    }
+  }
+
+private:
+  template <typename F>
+  static double run(int threads, const std::vector<int>& ks, F put) {
+    stopwatch sw;
+    std::vector<std::thread> ts;
+    for (int t = 0; t < threads; ++t) {
+      ts.emplace_back([&, t] {
+        for (size_t i = t; i < ks.size(); i += threads) { put(ks[i]); }
+      });
+    }
+    for (std::thread& th : ts) { th.join(); }
+    return sw.seconds();
+  }
+};
+
+
+#endif /* sharded_st_h */
@@ -0,0 +1,508 @@
+//
+//  st_snapshot.h
+//  sqb
+//
+//  Binary snapshots of an ordered symbol table.
+//
+//  A snapshot is the sorted (key, value) sequence written column by
+//  column after a fixed header:
+//
+//    header   magic "SQBSNAP", version, key/value widths, byte-order mark,
+//             count, payload size, FNV-1a checksum of the payload
+//    keys     fixed-width column: count raw Keys
+//             std::string column: count + 1 offsets, then the string arena
+//    values   the same, for Value
+//
+//  Every section starts on an 8-byte boundary and numbers are in native
+//  byte order (the byte-order mark rejects a file from the other kind of
+//  machine). A snapshot is written to path + ".tmp", fsynced and renamed
+//  over path, so a crash mid-save leaves the previous snapshot intact and
+//  a mapped_st already open on path keeps reading the file it mapped.
+//
+//  mapped_st mmaps a snapshot and answers lookups by binary search
+//  straight over the mapped columns: opening it costs one checksum pass
+//  and nothing is parsed or copied. Its begin()/end() also feed
+//  bst_redblack::build_from_sorted(), which is how bst_redblack::load()
+//  rebuilds a tree in linear time.
+//
+
+#ifndef st_snapshot_h
+#define st_snapshot_h
+
+#include <iostream>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utils.h"
+
+
+#define ST_SNAPSHOT_VERSION 1
+
+//---------------------------------------------------------
+struct snapshot_header {
+  char magic[8];               // "SQBSNAP\0"
+  uint32_t version;
+  uint32_t key_width;          // sizeof(Key), 0 for std::string
+  uint32_t value_width;        // sizeof(Value), 0 for std::string
+  uint32_t byte_order;         // SNAPSHOT_BYTE_ORDER as the writer saw it
+  uint64_t count;
+  uint64_t payload_bytes;
+  uint64_t checksum;           // FNV-1a 64 over the payload
+};
+
+static const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+static const char SNAPSHOT_MAGIC[8] = { 'S', 'Q', 'B', 'S', 'N', 'A', 'P', '\0' };
+
+inline uint64_t fnv1a(uint64_t h, const void* data, size_t n) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < n; ++i) { h = (h ^ p[i]) * 0x100000001b3ULL; }
+  return h;
+}
+static const uint64_t FNV1A_SEED = 0xcbf29ce484222325ULL;
+
+inline size_t snapshot_pad(size_t n) { return (n + 7) & ~(size_t)7; }
+
+
+//---------------------------------------------------------
+// makes the data of fd durable; F_FULLFSYNC is what reaches the disk on macOS
+inline void sync_fd(int fd) {
+#if defined(__APPLE__)
+  int rc = fcntl(fd, F_FULLFSYNC);
+#else
+  int rc = fdatasync(fd);
+#endif
+  if (rc != 0) { throw new std::runtime_error(std::string("fsync failed: ") + strerror(errno)); }
+}
+
+// fsyncs the directory holding path, so that a rename or create in it is durable
+inline void sync_parent_dir(const std::string& path) {
+  size_t slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+  int fd = ::open(dir.c_str(), O_RDONLY);
+  if (fd < 0) { throw new std::runtime_error("cannot open " + dir + ": " + strerror(errno)); }
+  if (fsync(fd) != 0) {
+    int err = errno;
+    ::close(fd);
+    throw new std::runtime_error("cannot sync " + dir + ": " + strerror(err));
+  }
+  ::close(fd);
+}
+
+// makes the complete file tmp durable and atomically puts it in place of
+// path: a crash leaves either the old file or the new one, and anyone who
+// has the old one open or mapped keeps reading the old one
+inline void replace_file(const std::string& tmp, const std::string& path) {
+  int fd = ::open(tmp.c_str(), O_RDONLY);
+  if (fd < 0) { throw new std::runtime_error("cannot reopen " + tmp + ": " + strerror(errno)); }
+  try {
+    sync_fd(fd);
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+  if (rename(tmp.c_str(), path.c_str()) != 0) {
+    throw new std::runtime_error("cannot install " + path + ": " + strerror(errno));
+  }
+  sync_parent_dir(path);
+}
+
+
+//---------------------------------------------------------
+// appends the payload, hashing it on the way; the header goes in last.
+// Everything is written to path + ".tmp", which finish() moves over path
+// with replace_file(); a writer dropped before that removes the temporary
+class snapshot_writer {
+public:
+  explicit snapshot_writer(const std::string& path) : path_(path), tmp_(path + ".tmp"),
+                                                      out_(tmp_, std::ios::binary | std::ios::trunc),
+                                                      hash_(FNV1A_SEED), bytes_(0) {
+    if (!out_.is_open()) { throw new std::runtime_error("cannot create snapshot: " + tmp_); }
+    snapshot_header h;
+    std::memset(&h, 0, sizeof h);
+    out_.write(reinterpret_cast<const char*>(&h), sizeof h);
+  }
+
+  snapshot_writer(const snapshot_writer&) = delete;
+  snapshot_writer& operator=(const snapshot_writer&) = delete;
+
+  ~snapshot_writer() {
+    if (!tmp_.empty()) {
+      out_.close();
+      unlink(tmp_.c_str());
+    }
+  }
+
+  void write(const void* p, size_t n) {
+    out_.write(static_cast<const char*>(p), n);
+    hash_ = fnv1a(hash_, p, n);
+    bytes_ += n;
+  }
+
+  void align() {
+    static const char zeros[8] = { 0 };
+    write(zeros, snapshot_pad(bytes_) - bytes_);
+  }
+
+  void finish(uint32_t key_width, uint32_t value_width, uint64_t count) {
+    snapshot_header h;
+    std::memcpy(h.magic, SNAPSHOT_MAGIC, sizeof h.magic);
+    h.version = ST_SNAPSHOT_VERSION;
+    h.key_width = key_width;
+    h.value_width = value_width;
+    h.byte_order = SNAPSHOT_BYTE_ORDER;
+    h.count = count;
+    h.payload_bytes = bytes_;
+    h.checksum = hash_;
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char*>(&h), sizeof h);
+    out_.close();
+    if (!out_) { throw new std::runtime_error("error writing snapshot: " + tmp_); }
+    replace_file(tmp_, path_);
+    tmp_.clear();
+  }
+
+private:
+  std::string path_;
+  std::string tmp_;            // emptied once it has replaced path_
+  std::ofstream out_;
+  uint64_t hash_;
+  uint64_t bytes_;
+};
+
+
+//---------------------------------------------------------
+// how one column is stored; T must be trivially copyable
+template <typename T>
+struct snapshot_column {
+  static_assert(std::is_trivially_copyable<T>::value, "snapshot columns need trivially copyable types or std::string");
+  static_assert(alignof(T) <= 8, "snapshot columns are 8-byte aligned");
+  typedef T view;
+  static const uint32_t width = sizeof(T);
+
+  template <typename It, typename Get>
+  static void write(snapshot_writer& w, It first, It last, Get get) {
+    for (It it = first; it != last; ++it) {
+      const typename std::iterator_traits<It>::value_type& kv = *it;
+      w.write(&get(kv), sizeof(T));
+    }
+    w.align();
+  }
+
+  // p is the start of the column and end the end of the payload; returns
+  // the byte just past the column, after checking that it fits
+  static const char* open(const char* p, const char* end, uint64_t n, const char*& base, const uint64_t*&) {
+    if (n > (uint64_t)(end - p) / sizeof(T)) { throw new std::runtime_error("snapshot column overruns the file"); }
+    base = p;
+    return p + snapshot_pad(n * sizeof(T));
+  }
+
+  static view at(const char* base, const uint64_t*, size_t i) {
+    T x;
+    std::memcpy(&x, base + i * sizeof(T), sizeof(T));
+    return x;
+  }
+};
+
+template <>
+struct snapshot_column<std::string> {
+  typedef std::string_view view;
+  static const uint32_t width = 0;
+
+  template <typename It, typename Get>
+  static void write(snapshot_writer& w, It first, It last, Get get) {
+    uint64_t off = 0;
+    w.write(&off, sizeof off);
+    for (It it = first; it != last; ++it) {
+      const typename std::iterator_traits<It>::value_type& kv = *it;
+      off += get(kv).size();
+      w.write(&off, sizeof off);
+    }
+    for (It it = first; it != last; ++it) {
+      const typename std::iterator_traits<It>::value_type& kv = *it;
+      w.write(get(kv).data(), get(kv).size());
+    }
+    w.align();
+  }
+
+  // the offsets must start at 0, never decrease and end inside the file
+  static const char* open(const char* p, const char* end, uint64_t n, const char*& base, const uint64_t*& offsets) {
+    if (n >= (uint64_t)(end - p) / sizeof(uint64_t)) { throw new std::runtime_error("snapshot offsets overrun the file"); }
+    offsets = reinterpret_cast<const uint64_t*>(p);
+    base = p + (n + 1) * sizeof(uint64_t);
+    if (offsets[0] != 0) { throw new std::runtime_error("snapshot offsets do not start at 0"); }
+    for (uint64_t i = 0; i < n; ++i) {
+      if (offsets[i + 1] < offsets[i]) { throw new std::runtime_error("snapshot offsets decrease"); }
+    }
+    if (offsets[n] > (uint64_t)(end - base)) { throw new std::runtime_error("snapshot strings overrun the file"); }
+    return base + snapshot_pad(offsets[n]);
+  }
+
+  static view at(const char* base, const uint64_t* offsets, size_t i) {
+    return std::string_view(base + offsets[i], offsets[i + 1] - offsets[i]);
+  }
+};
+
+
+//---------------------------------------------------------
+// writes [first, last), n (key, value) pairs in strictly increasing key
+// order, e.g. a bst_redblack's begin()/end()
+template <typename Key, typename Value, typename It>
+void save_snapshot(const std::string& path, It first, It last, size_t n) {
+  typedef snapshot_column<Key> keys;
+  typedef snapshot_column<Value> vals;
+  snapshot_writer w(path);
+  keys::write(w, first, last, [](const typename std::iterator_traits<It>::value_type& kv) -> const Key& { return kv.first; });
+  vals::write(w, first, last, [](const typename std::iterator_traits<It>::value_type& kv) -> const Value& { return kv.second; });
+  w.finish(keys::width, vals::width, n);
+}
+
+
+//---------------------------------------------------------
+// read-only ordered table served from a mapped snapshot. Keys and values
+// come back as views (std::string_view for std::string columns) that stay
+// valid while the table is alive
+template <typename Key, typename Value, typename Compare = three_way<Key>>
+class mapped_st {
+  typedef snapshot_column<Key> key_column;
+  typedef snapshot_column<Value> value_column;
+
+public:
+  typedef typename key_column::view key_view;
+  typedef typename value_column::view value_view;
+
+  // verify = false skips the checksum pass, for files that are trusted
+  explicit mapped_st(const std::string& path, bool verify = true, const Compare& comp = Compare())
+  : map_(nullptr), bytes_(0), n_(0), keys_(nullptr), vals_(nullptr),
+    key_offsets_(nullptr), value_offsets_(nullptr), comp_(comp) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) { throw new std::runtime_error("cannot open snapshot: " + path); }
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(snapshot_header)) {
+      ::close(fd);
+      throw new std::runtime_error("snapshot too short: " + path);
+    }
+    bytes_ = (size_t)sb.st_size;
+    void* m = mmap(nullptr, bytes_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) { throw new std::runtime_error("cannot map snapshot: " + path); }
+    map_ = static_cast<const char*>(m);
+    try {
+      open_(verify);
+    } catch (...) {
+      munmap(const_cast<char*>(map_), bytes_);
+      throw;
+    }
+  }
+
+  mapped_st(const mapped_st&) = delete;
+  mapped_st& operator=(const mapped_st&) = delete;
+  ~mapped_st() { if (map_ != nullptr) { munmap(const_cast<char*>(map_), bytes_); } }
+
+  int size() const { return (int)n_; }
+  bool is_empty() const { return n_ == 0; }
+  size_t bytes() const { return bytes_; }
+
+  key_view key_at(int r) const { return key_column::at(keys_, key_offsets_, r); }
+  value_view value_at(int r) const { return value_column::at(vals_, value_offsets_, r); }
+
+  // any type Compare accepts next to a key_view, e.g. const char* for
+  // std::string keys
+  template <typename K>
+  Value get(const K& k) const {
+    size_t r = lower(k);
+    return (r < n_ && comp_(k, key_at((int)r)) == 0) ? Value(value_at((int)r)) : Value();
+  }
+  template <typename K>
+  bool contains(const K& k) const { return get(k) != Value(); }
+
+  // number of keys < k
+  template <typename K>
+  int rank(const K& k) const { return (int)lower(k); }
+
+  Key select(int r) const {
+    if (r < 0 || (size_t)r >= n_) { throw new std::invalid_argument("invalid select"); }
+    return Key(key_at(r));
+  }
+
+  // yields pairs of views in key order; it->first works too, as
+  // build_from_sorted() needs
+  class iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef std::pair<key_view, value_view> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef void pointer;
+    typedef value_type reference;
+
+    struct arrow {
+      value_type kv;
+      const value_type* operator->() const { return &kv; }
+    };
+
+    iterator(const mapped_st* st, size_t r) : st_(st), r_(r) { }
+    value_type operator*() const { return value_type(st_->key_at((int)r_), st_->value_at((int)r_)); }
+    arrow operator->() const { return arrow{**this}; }
+    iterator& operator++() { ++r_;  return *this; }
+    iterator operator++(int) { iterator before = *this;  ++r_;  return before; }
+    bool operator==(const iterator& other) const { return r_ == other.r_; }
+    bool operator!=(const iterator& other) const { return r_ != other.r_; }
+
+  private:
+    const mapped_st* st_;
+    size_t r_;
+  };
+
+  iterator begin() const { return iterator(this, 0); }
+  iterator end() const { return iterator(this, n_); }
+
+private:
+  void open_(bool verify) {
+    snapshot_header h;
+    std::memcpy(&h, map_, sizeof h);
+    if (std::memcmp(h.magic, SNAPSHOT_MAGIC, sizeof h.magic) != 0) { throw new std::runtime_error("not a snapshot"); }
+    if (h.version != ST_SNAPSHOT_VERSION) { throw new std::runtime_error("unsupported snapshot version"); }
+    if (h.byte_order != SNAPSHOT_BYTE_ORDER) { throw new std::runtime_error("snapshot has the wrong byte order"); }
+    if (h.key_width != key_column::width || h.value_width != value_column::width) {
+      throw new std::runtime_error("snapshot key/value types do not match");
+    }
+    if (h.payload_bytes != bytes_ - sizeof h) { throw new std::runtime_error("snapshot is truncated"); }
+    const char* payload = map_ + sizeof h;
+    if (verify && fnv1a(FNV1A_SEED, payload, h.payload_bytes) != h.checksum) {
+      throw new std::runtime_error("snapshot checksum mismatch");
+    }
+    // the checksum covers the payload only: count is checked against the
+    // section sizes before anything is read through it
+    if (h.count > (uint64_t)INT_MAX) { throw new std::runtime_error("snapshot count out of range"); }
+    const char* end = payload + h.payload_bytes;
+    const char* p = key_column::open(payload, end, h.count, keys_, key_offsets_);
+    if (p > end) { throw new std::runtime_error("snapshot sections do not add up"); }
+    p = value_column::open(p, end, h.count, vals_, value_offsets_);
+    if (p != end) { throw new std::runtime_error("snapshot sections do not add up"); }
+    n_ = h.count;
+  }
+
+  // rank of the first key >= k
+  template <typename K>
+  size_t lower(const K& k) const {
+    size_t lo = 0, len = n_;
+    while (len > 0) {
+      size_t half = len / 2;
+      bool right = comp_(key_at((int)(lo + half)), k) < 0;
+      lo = right ? lo + half + 1 : lo;
+      len = right ? len - half - 1 : half;
+    }
+    return lo;
+  }
+
+  const char* map_;
+  size_t bytes_;
+  size_t n_;
+  const char* keys_;
+  const char* vals_;
+  const uint64_t* key_offsets_;
+  const uint64_t* value_offsets_;
+  Compare comp_;
+};
+
+
+//---------------------------------------------------------
+// saves a small <std::string, std::string> snapshot to path, then damages
+// its header and its key offsets in turn: mapped_st must refuse every
+// damaged copy with an exception, whether or not it verifies the checksum
+inline void test_snapshot_corruption(const std::string& path) {
+  std::vector<std::pair<std::string, std::string>> kv;
+  for (int i = 100; i < 200; ++i) { kv.emplace_back("key" + std::to_string(i), "value" + std::to_string(i)); }
+  save_snapshot<std::string, std::string>(path, kv.begin(), kv.end(), kv.size());
+  std::string good;
+  {
+    std::ifstream in(path, std::ios::binary);
+    good.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  auto put_u64 = [](std::string& b, size_t at, uint64_t x) { std::memcpy(&b[at], &x, sizeof x); };
+  auto refused = [&](const char* what, const std::string& bytes, bool verify) {
+    {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      out.write(bytes.data(), bytes.size());
+    }
+    try {
+      mapped_st<std::string, std::string> st(path, verify);
+    } catch (std::runtime_error* e) {
+      std::cout << "  " << what << ": refused (" << e->what() << ")\n";
+      delete e;
+      return;
+    }
+    throw new std::logic_error(std::string("test_snapshot_corruption: accepted ") + what);
+  };
+
+  const size_t count_at = offsetof(snapshot_header, count);
+  const size_t offsets_at = sizeof(snapshot_header);
+  std::cout << "test_snapshot_corruption: '" << path << "'\n";
+  std::string b;
+  b = good;  put_u64(b, count_at, 10000000);                  refused("count 10000000", b, true);
+  b = good;  put_u64(b, count_at, UINT64_MAX / 8);            refused("count 2^61", b, true);
+  b = good;  put_u64(b, count_at, kv.size() - 1);             refused("count one short", b, true);
+  b = good;  put_u64(b, offsets_at, 1);                       refused("first offset 1", b, false);
+  b = good;  put_u64(b, offsets_at + 5 * 8, 0);               refused("decreasing offset", b, false);
+  b = good;  put_u64(b, offsets_at + kv.size() * 8, 1 << 20); refused("last offset past the end", b, false);
+  b = good;  b.resize(b.size() - 8);                           refused("truncated", b, true);
+
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(good.data(), good.size());
+  }
+  mapped_st<std::string, std::string> st(path);
+  if (st.size() != (int)kv.size() || st.get("key150") != "value150") {
+    throw new std::logic_error("test_snapshot_corruption: the intact snapshot reads back wrong");
+  }
+  std::cout << "  intact: " << st.size() << " entries, ok\n";
+}
+
+
+// saves over a snapshot that a mapped_st is serving, and abandons a save
+// part way: the open table must keep reading its own file, the new one
+// must be complete, and an abandoned save must leave the old one alone
+inline void test_snapshot_replace(const std::string& path) {
+  std::cout << "test_snapshot_replace: '" << path << "'\n";
+  std::vector<std::pair<int, int>> big, one;
+  for (int i = 0; i < 200000; ++i) { big.emplace_back(i, -i); }
+  one.emplace_back(7, 70);
+  save_snapshot<int, int>(path, big.begin(), big.end(), big.size());
+  mapped_st<int, int> old(path);
+  save_snapshot<int, int>(path, one.begin(), one.end(), one.size());
+  if (old.size() != (int)big.size() || old.get(150000) != -150000) {
+    throw new std::logic_error("test_snapshot_replace: the open table lost its file");
+  }
+  std::cout << "  open table after save: " << old.size() << " entries, ok\n";
+  {
+    snapshot_writer w(path);
+    w.write(big.data(), 1000 * sizeof big[0]);
+  }
+  struct stat sb;
+  if (stat((path + ".tmp").c_str(), &sb) == 0) {
+    throw new std::logic_error("test_snapshot_replace: an abandoned save left its temporary behind");
+  }
+  mapped_st<int, int> now(path);
+  if (now.size() != 1 || now.get(7) != 70) {
+    throw new std::logic_error("test_snapshot_replace: the new snapshot reads back wrong");
+  }
+  std::cout << "  after an abandoned save: " << now.size() << " entry, ok\n";
+}
+
+
+#endif /* st_snapshot_h */
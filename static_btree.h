@@ -0,0 +1,242 @@
+//
+//  static_btree.h
+//  sqb
+//
+//  Read-only static B+tree (S+tree) index for integer and other fixed-width
+//  keys.
+//
+//  Every node is STATIC_BTREE_B keys, one cache line for 32-bit keys. The
+//  leaves hold all keys in sorted order, padded with the largest Key; an
+//  internal node stores, for each of its first B children, the largest key
+//  under that child, and its B + 1 children are found by arithmetic, so
+//  there are no pointers at all. Searching a node means counting its keys
+//  that are < x, which for 32-bit ints is two AVX2 (or four SSE2) compares
+//  and a movemask; every other Key type uses a scalar, branch-free count.
+//  A lookup touches one node per level, log_17(n) levels in all.
+//
+
+#ifndef static_btree_h
+#define static_btree_h
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "bst_redblack.h"
+#include "utils.h"
+
+
+#define STATIC_BTREE_B 16
+
+//---------------------------------------------------------
+// number of keys in node[0..STATIC_BTREE_B) that are < x
+template <typename Key>
+struct static_btree_rank {
+  static int rank(const Key* node, const Key& x) {
+    int r = 0;
+    for (int i = 0; i < STATIC_BTREE_B; ++i) { r += node[i] < x; }
+    return r;
+  }
+};
+
+#if defined(__AVX2__) || defined(__SSE2__)
+template <>
+struct static_btree_rank<int32_t> {
+  static int rank(const int32_t* node, const int32_t& x) {
+#if defined(__AVX2__)
+    __m256i v = _mm256_set1_epi32(x);
+    __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i*>(node));
+    __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i*>(node + 8));
+    int ma = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, a)));
+    int mb = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, b)));
+    return __builtin_popcount(ma | (mb << 8));
+#else
+    __m128i v = _mm_set1_epi32(x);
+    int m = 0;
+    for (int i = 0; i < STATIC_BTREE_B; i += 4) {
+      __m128i a = _mm_load_si128(reinterpret_cast<const __m128i*>(node + i));
+      m |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, a))) << i;
+    }
+    return __builtin_popcount(m);
+#endif
+  }
+};
+#endif
+
+
+//---------------------------------------------------------
+template <typename Key, typename Value>
+class static_btree {
+  static_assert(std::numeric_limits<Key>::is_specialized, "static_btree needs a fixed-width arithmetic Key");
+
+public:
+  static const int B = STATIC_BTREE_B;
+
+  static_btree() : n_(0), data_(nullptr) { }
+
+  // [first, last) yields (key, value) pairs in strictly increasing key
+  // order, e.g. a bst_redblack's begin()/end()
+  template <typename It>
+  static_btree(It first, It last) : n_(0), data_(nullptr) {
+    std::vector<Key> keys;
+    for (It it = first; it != last; ++it) {
+      keys.push_back((*it).first);
+      vals_.push_back((*it).second);
+    }
+    build(keys);
+  }
+
+  static_btree(const static_btree&) = delete;
+  static_btree& operator=(const static_btree&) = delete;
+  static_btree(static_btree&& other)
+  : n_(other.n_), data_(other.data_), vals_(std::move(other.vals_)),
+    offset_(std::move(other.offset_)), nodes_(std::move(other.nodes_)) {
+    other.n_ = 0;
+    other.data_ = nullptr;
+  }
+  ~static_btree() { if (data_ != nullptr) { ::operator delete(data_, std::align_val_t(64)); } }
+
+  int size() const { return (int)n_; }
+  bool is_empty() const { return n_ == 0; }
+
+  // number of keys < x
+  int rank(const Key& x) const { return (int)lower(x); }
+
+  Value get(const Key& x) const {
+    size_t r = lower(x);
+    return (r < n_ && !(x < leaf_key(r))) ? vals_[r] : Value();
+  }
+  bool contains(const Key& x) const { return get(x) != Value(); }
+
+  Key select(int r) const {
+    if (r < 0 || (size_t)r >= n_) { throw new std::invalid_argument("invalid select"); }
+    return leaf_key(r);
+  }
+
+  size_t bytes() const {
+    return (offset_.empty() ? 0 : offset_.back() * sizeof(Key)) + vals_.capacity() * sizeof(Value);
+  }
+
+private:
+  // layer 0 is the leaves; data_ holds the top layer first, so a lookup
+  // moves forward through memory
+  void build(std::vector<Key>& keys) {
+    n_ = keys.size();
+    const Key pad = std::numeric_limits<Key>::max();
+
+    std::vector<std::vector<Key>> layers;
+    std::vector<Key> maxes;                      // largest key under each node of the last layer built
+    size_t m = std::max<size_t>(1, (n_ + B - 1) / B);
+    keys.resize(m * B, pad);
+    layers.push_back(keys);
+    for (size_t i = 0; i < m; ++i) { maxes.push_back(keys[i * B + B - 1]); }
+
+    while (m > 1) {
+      size_t up = (m + B) / (B + 1);
+      std::vector<Key> layer(up * B, pad);
+      std::vector<Key> up_maxes(up, pad);
+      for (size_t i = 0; i < up; ++i) {
+        for (int j = 0; j < B; ++j) {
+          size_t c = i * (B + 1) + j;
+          if (c < m) { layer[i * B + j] = maxes[c]; }
+        }
+        size_t last = std::min(m - 1, i * (B + 1) + B);
+        up_maxes[i] = maxes[last];
+      }
+      layers.push_back(layer);
+      maxes.swap(up_maxes);
+      m = up;
+    }
+
+    size_t total = 0;
+    for (auto it = layers.rbegin(); it != layers.rend(); ++it) {
+      offset_.push_back(total);
+      nodes_.push_back(it->size() / B);
+      total += it->size();
+    }
+    offset_.push_back(total);
+    data_ = static_cast<Key*>(::operator new(total * sizeof(Key), std::align_val_t(64)));
+    for (size_t l = 0; l < layers.size(); ++l) {
+      const std::vector<Key>& layer = layers[layers.size() - 1 - l];
+      std::copy(layer.begin(), layer.end(), data_ + offset_[l]);
+    }
+  }
+
+  // rank of the first key >= x
+  size_t lower(const Key& x) const {
+    if (n_ == 0) { return 0; }
+    size_t k = 0;
+    size_t depth = nodes_.size();
+    for (size_t l = 0; l + 1 < depth; ++l) {
+      int r = static_btree_rank<Key>::rank(data_ + offset_[l] + k * B, x);
+      // children past the end exist only when every key is < x; they all
+      // clamp to the last node, whose padding then answers n
+      k = std::min(k * (B + 1) + r, nodes_[l + 1] - 1);
+    }
+    size_t pos = k * B + static_btree_rank<Key>::rank(data_ + offset_[depth - 1] + k * B, x);
+    return std::min(pos, n_);
+  }
+
+  const Key& leaf_key(size_t r) const { return data_[offset_[nodes_.size() - 1] + r]; }
+
+  size_t n_;
+  Key* data_;
+  std::vector<Value> vals_;
+  std::vector<size_t> offset_;       // start of each layer in data_, top first
+  std::vector<size_t> nodes_;        // nodes in each layer
+
+  //-------- benchmark ----------------------------------------------------------------
+public:
+  // random lookups on n int keys: static_btree vs bst_redblack vs std::map
+  static void bench(int n) {
+    std::vector<std::pair<int, int>> kvs(n);
+    for (int i = 0; i < n; ++i) { kvs[i] = std::make_pair(2 * i + 1, i + 1); }
+    bst_redblack<int, int> st = bst_redblack<int, int>::build_from_sorted(kvs.begin(), kvs.end());
+    std::map<int, int> m(kvs.begin(), kvs.end());
+    static_btree<int, int> bt(st.begin(), st.end());
+
+    std::mt19937 gen(20200311);
+    std::uniform_int_distribution<int> pick(1, 2 * n);
+    std::vector<int> qs(2000000);
+    for (int& k : qs) { k = pick(gen); }
+
+    std::cout << "static_btree bench: " << n << " int keys, " << qs.size() << " random lookups"
+#if defined(__AVX2__)
+              << " (AVX2)\n";
+#elif defined(__SSE2__)
+              << " (SSE2)\n";
+#else
+              << " (scalar)\n";
+#endif
+    long s1 = 0, s2 = 0, s3 = 0;
+    stopwatch sw;
+    for (int k : qs) { s1 += st.get(k); }
+    double t1 = sw.seconds();
+    sw.reset();
+    for (int k : qs) { auto it = m.find(k);  s2 += it == m.end() ? 0 : it->second; }
+    double t2 = sw.seconds();
+    sw.reset();
+    for (int k : qs) { s3 += bt.get(k); }
+    double t3 = sw.seconds();
+    if (s1 != s2 || s1 != s3) { throw new std::logic_error("static_btree bench: results differ"); }
+
+    double q = (double)qs.size();
+    std::cout << "  bst_redblack: " << std::setw(7) << t1 * 1e9 / q << " ns/lookup\n";
+    std::cout << "  std::map:     " << std::setw(7) << t2 * 1e9 / q << " ns/lookup\n";
+    std::cout << "  static_btree: " << std::setw(7) << t3 * 1e9 / q << " ns/lookup  ("
+              << bt.bytes() / 1024 << " KiB)\n";
+  }
+};
+
+
+#endif /* static_btree_h */
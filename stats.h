@@ -0,0 +1,129 @@
+//
+//  stats.h
+//  sqb
+//
+//  Instrumentation policies for the search trees.
+//
+//  A tree calls a hook on its policy for every key comparison, node
+//  visited by a search, rotation, color flip, move_red_left/right and node
+//  allocation, and reports the depth at which each lookup ended. The hooks
+//  of no_stats are empty inline functions, so a tree built with it
+//  compiles to the same code as one without hooks; counting_stats keeps
+//  counters and a histogram of lookup depths. Its counters are relaxed
+//  atomics: the set operations run split() and compare on pool workers,
+//  and const lookups may run on several threads, all bumping one policy.
+//
+
+#ifndef stats_h
+#define stats_h
+
+#include <iostream>
+#include <atomic>
+#include <sstream>
+#include <string>
+
+
+//---------------------------------------------------------
+struct no_stats {
+  static const bool enabled = false;
+
+  void compared() { }
+  void visited() { }
+  void rotated_left() { }
+  void rotated_right() { }
+  void flipped() { }
+  void moved_red_left() { }
+  void moved_red_right() { }
+  void allocated() { }
+  void freed() { }
+  void looked_up(int) { }
+
+  void reset() { }
+  void to_json(std::ostream& os) const { os << "{}"; }
+  std::string to_json() const { return "{}"; }
+};
+
+
+//---------------------------------------------------------
+// a long that any thread may bump; relaxed, since only the totals are read
+struct stat_counter {
+  std::atomic<long> n;
+
+  stat_counter(long v = 0) : n(v) { }
+  stat_counter(const stat_counter& o) : n((long)o) { }
+  stat_counter& operator=(const stat_counter& o) { n.store((long)o, std::memory_order_relaxed);  return *this; }
+  stat_counter& operator=(long v) { n.store(v, std::memory_order_relaxed);  return *this; }
+
+  void operator++() { n.fetch_add(1, std::memory_order_relaxed); }
+  operator long() const { return n.load(std::memory_order_relaxed); }
+};
+
+
+//---------------------------------------------------------
+struct counting_stats {
+  static const bool enabled = true;
+  static const int DEPTHS = 64;      // deeper lookups land in the last bucket
+
+  stat_counter comparisons, visits;
+  stat_counter rotate_lefts, rotate_rights, flips;
+  stat_counter move_red_lefts, move_red_rights;
+  stat_counter allocations, frees;
+  stat_counter depth[DEPTHS];        // depth[d]: lookups that visited d nodes
+
+  counting_stats() { reset(); }
+
+  void compared()        { ++comparisons; }
+  void visited()         { ++visits; }
+  void rotated_left()    { ++rotate_lefts; }
+  void rotated_right()   { ++rotate_rights; }
+  void flipped()         { ++flips; }
+  void moved_red_left()  { ++move_red_lefts; }
+  void moved_red_right() { ++move_red_rights; }
+  void allocated()       { ++allocations; }
+  void freed()           { ++frees; }
+  void looked_up(int d)  { ++depth[d < DEPTHS ? d : DEPTHS - 1]; }
+
+  void reset() {
+    comparisons = visits = 0;
+    rotate_lefts = rotate_rights = flips = 0;
+    move_red_lefts = move_red_rights = 0;
+    allocations = frees = 0;
+    for (int d = 0; d < DEPTHS; ++d) { depth[d] = 0; }
+  }
+
+  long lookups() const {
+    long n = 0;
+    for (int d = 0; d < DEPTHS; ++d) { n += depth[d]; }
+    return n;
+  }
+
+  double mean_depth() const {
+    long n = 0, sum = 0;
+    for (int d = 0; d < DEPTHS; ++d) { n += depth[d];  sum += d * depth[d]; }
+    return n == 0 ? 0.0 : (double)sum / n;
+  }
+
+  // one JSON object; the histogram is cut after its last non-empty bucket
+  void to_json(std::ostream& os) const {
+    os << "{\"comparisons\":" << comparisons << ",\"visits\":" << visits
+       << ",\"rotate_left\":" << rotate_lefts << ",\"rotate_right\":" << rotate_rights
+       << ",\"flip_colors\":" << flips
+       << ",\"move_red_left\":" << move_red_lefts << ",\"move_red_right\":" << move_red_rights
+       << ",\"allocations\":" << allocations << ",\"frees\":" << frees
+       << ",\"lookups\":" << lookups() << ",\"mean_depth\":" << mean_depth()
+       << ",\"depth_histogram\":[";
+    int last = DEPTHS;
+    while (last > 0 && depth[last - 1] == 0) { --last; }
+    for (int d = 0; d < last; ++d) { os << (d == 0 ? "" : ",") << depth[d]; }
+    os << "]}";
+  }
+
+  std::string to_json() const {
+    std::ostringstream os;
+    to_json(os);
+    return os.str();
+  }
+};
+
+
+#endif /* stats_h */
@@ -0,0 +1,136 @@
+//
+//  thread_pool.h
+//  sqb
+//
+//  Fixed-size pool for fork-join recursion. A thread waiting on a task
+//  keeps running queued tasks itself, so nested submit()/wait() pairs never
+//  deadlock even when every worker is blocked in a wait(). An exception
+//  thrown by a task is caught where it ran and rethrown by wait().
+//
+
+#ifndef thread_pool_h
+#define thread_pool_h
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class thread_pool {
+public:
+  struct task {
+    explicit task(std::function<void()> fn_) : fn(std::move(fn_)), done(false) { }
+    std::function<void()> fn;
+    std::exception_ptr error;    // written before done is set
+    std::atomic<bool> done;
+  };
+  typedef std::shared_ptr<task> handle;
+
+  explicit thread_pool(size_t threads) : stop_(false) {
+    for (size_t i = 0; i < threads; ++i) { workers_.emplace_back([this] { work(); }); }
+  }
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread& t : workers_) { t.join(); }
+  }
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  size_t size() const { return workers_.size(); }
+
+  handle submit(std::function<void()> fn) {
+    handle t = std::make_shared<task>(std::move(fn));
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(t);
+    }
+    cv_.notify_one();
+    return t;
+  }
+
+  // blocks until t has run, running other queued tasks meanwhile;
+  // rethrows what t threw
+  void wait(const handle& t) {
+    while (!t->done.load(std::memory_order_acquire)) {
+      if (!run_one()) { std::this_thread::yield(); }
+    }
+    if (t->error != nullptr) { std::rethrow_exception(t->error); }
+  }
+
+private:
+  // newest task first: in fork-join that is usually the one being waited on
+  bool run_one() {
+    handle t;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (queue_.empty()) { return false; }
+      t = queue_.back();
+      queue_.pop_back();
+    }
+    run(t);
+    return true;
+  }
+
+  static void run(const handle& t) {
+    try {
+      t->fn();
+    } catch (...) {
+      t->error = std::current_exception();
+    }
+    t->done.store(true, std::memory_order_release);
+  }
+
+  void work() {
+    while (true) {
+      handle t;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (stop_ && queue_.empty()) { return; }
+        t = queue_.front();
+        queue_.pop_front();
+      }
+      run(t);
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::deque<handle> queue_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_;
+};
+
+
+// runs f and g, g on the pool when one is given and parallel is set.
+// g may refer to the caller's frame, so it is waited for even when f
+// throws; f's exception then wins over g's
+template <typename F, typename G>
+void parallel_invoke(thread_pool* pool, bool parallel, F f, G g) {
+  if (pool == nullptr || !parallel) {
+    f();
+    g();
+    return;
+  }
+  thread_pool::handle t = pool->submit(g);
+  try {
+    f();
+  } catch (...) {
+    try { pool->wait(t); } catch (...) { }
+    throw;
+  }
+  pool->wait(t);
+}
+
+
+#endif /* thread_pool_h */
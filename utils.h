@@ -12,6 +12,14 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unistd.h>
+#if __cplusplus >= 202002L
+#include <compare>
+#endif
 
 
 #define ARGC_ERROR  1
@@ -122,19 +130,19 @@ struct comparator {
 };
 
 template <typename T>
-struct fwd_comparator : public comparator<T> {
+struct fwd_comparator final : public comparator<T> {
   virtual bool operator()(const T& v, const T& w) const override {
     return v < w;
   }
 };
 
 template <typename T>
-struct rev_comparator : public comparator<T> {
+struct rev_comparator final : public comparator<T> {
   virtual bool operator()(const T& v, const T& w) const override { return w < v; }
 };
 
 template <typename T>
-struct null_comparator : public comparator<T> {
+struct null_comparator final : public comparator<T> {
   virtual bool operator()(const T& v, const T& w) const override { return false; }
 };
 
@@ -151,10 +159,12 @@ struct comparator_lambda : public comparator<T> {
 };
 
 template <typename T>
-bool less(T& v, T& w) { return v < w; }
+bool less(const T& v, const T& w) { return v < w; }
 
-template <typename T>
-bool less(T& v, T& w, const comparator<T>& comp) {
+// comp is any less-than callable; taken by its own type so that a concrete
+// (e.g. final) comparator is called directly and can be inlined
+template <typename T, typename Comp>
+bool less(const T& v, const T& w, const Comp& comp) {
   bool value = comp(v, w);
   return value;
 }
@@ -165,7 +175,7 @@ bool less(T& v, T& w, const comparator<T>& comp) {
 
 
 template <typename T>
-bool compare(T& v, T& w) {
+int compare(const T& v, const T& w) {
   int result;
 
   if (less(v, w))        { result = -1;
@@ -175,8 +185,8 @@ bool compare(T& v, T& w) {
   return result;
 }
 
-template <typename T>
-int compare(T& v, T& w, const comparator<T>& comp) {
+template <typename T, typename Comp>
+int compare(const T& v, const T& w, const Comp& comp) {
   int result;
 
   if (less(v, w, comp))        { result = -1;
@@ -187,6 +197,38 @@ int compare(T& v, T& w, const comparator<T>& comp) {
 }
 
 
+// three-way comparison policy for ordered tables: one call per node that is
+// < 0, == 0 or > 0. Uses <=> when the type has it (C++20) and a single
+// compare() for strings; otherwise falls back to two inlined < tests.
+template <typename T>
+struct three_way {
+  int operator()(const T& v, const T& w) const {
+#if __cplusplus >= 202002L
+    if constexpr (std::three_way_comparable<T>) {
+      auto c = v <=> w;
+      return c < 0 ? -1 : (c > 0 ? 1 : 0);
+    }
+#endif
+    return v < w ? -1 : (w < v ? 1 : 0);
+  }
+};
+
+// transparent: std::string, std::string_view and const char* keys all
+// compare through a string_view, so a lookup never builds a std::string
+template <>
+struct three_way<std::string> {
+  typedef void is_transparent;
+  int operator()(std::string_view v, std::string_view w) const { return v.compare(w); }
+};
+
+// three-way policy built from a less-than comparator (e.g. rev_comparator)
+template <typename T, typename Less>
+struct three_way_from_less {
+  int operator()(const T& v, const T& w) const { return less_(w, v) - less_(v, w); }
+  Less less_;
+};
+
+
 template <typename T>
 void exchange(T* a, size_t i, size_t j) {
   T swap = a[i];
@@ -203,8 +245,8 @@ bool is_sorted(T* a, size_t low, size_t high) {
   return true;
 }
 
-template <typename T>
-bool is_sorted(T* a, size_t low, size_t high, const comparator<T>& comp) {
+template <typename T, typename Comp>
+bool is_sorted(T* a, size_t low, size_t high, const Comp& comp) {
   for (size_t i = low + 1; i < high; ++i) {
     if (less(a[i], a[i - 1], comp)) { return false; }
   }
@@ -215,14 +257,39 @@ bool is_sorted(T* a, size_t low, size_t high, const comparator<T>& comp) {
 template <typename T>
 bool is_sorted(T* a, size_t size) { return is_sorted(a, 0, size - 1); }
 
-template <typename T>
-bool is_sorted(T* a, size_t size, const comparator<T>& comp) {
+// not for an integral Comp, which is is_sorted(a, low, high)
+template <typename T, typename Comp,
+          typename = typename std::enable_if<!std::is_integral<Comp>::value>::type>
+bool is_sorted(T* a, size_t size, const Comp& comp) {
   return is_sorted(a, 0, size - 1, comp);
 }
 
 
 
 
+//==========================================================================
+// benchmarking utilities
+//==========================================================================
+class stopwatch {
+public:
+  stopwatch() : start_(std::chrono::steady_clock::now()) { }
+  void reset() { start_ = std::chrono::steady_clock::now(); }
+  double seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+  }
+private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// resident set size of this process in kB (0 where /proc is unavailable)
+inline size_t current_rss_kb() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  if (!(statm >> pages >> resident)) { return 0; }
+  return resident * (size_t)sysconf(_SC_PAGESIZE) / 1024;
+}
+
+
 //==========================================================================
 
 